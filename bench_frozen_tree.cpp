@@ -0,0 +1,61 @@
+#include "quadtree.h"
+#include "vec2.h"
+#include <iostream>
+#include <cstdio>
+#include <ctime>
+#include <cstdlib>
+
+#define GRID_SIZE 800
+#define QUERIES 1000000
+#define REGIONS 10000
+
+using std::cout;
+using std::cin;
+
+using namespace qt;
+
+void fill_tree(QuadTree<int> &tree, int grid_size) {
+    for (int i = -grid_size; i < grid_size; ++i) {
+        for (int j = -grid_size; j < grid_size; ++j) {
+            tree.insert(Vertex(i, j), 2 * i + 9);
+        }
+    }
+}
+
+// Point lookups and small region queries at random places, the same sequence for every tree.
+template<typename Tree>
+void benchmark(const char *name, Tree &tree, int grid_size) {
+    srand(42);
+    long long checksum = 0;
+    clock_t start = clock();
+    for (int i = 0; i < QUERIES; ++i) {
+        auto data = tree.at(Vertex(rand() % (2 * grid_size) - grid_size, rand() % (2 * grid_size) - grid_size));
+        if (data != nullptr) checksum += *data;
+    }
+    clock_t middle = clock();
+    for (int i = 0; i < REGIONS; ++i) {
+        Vertex bottom_left(rand() % (2 * grid_size) - grid_size, rand() % (2 * grid_size) - grid_size);
+        checksum += tree.data_in_region(bottom_left, bottom_left + Vertex(40, 40)).size();
+    }
+    clock_t stop = clock();
+
+    printf("%s\t", name);
+    printf("%.5f\t", (double) (middle - start) / CLOCKS_PER_SEC);
+    printf("%.5f\t", (double) (stop - middle) / CLOCKS_PER_SEC);
+    printf("%lld\n", checksum);
+}
+
+int main() {
+    QuadTree<int> tree{{0, 0}, {GRID_SIZE, GRID_SIZE}, 8, 16, false};
+    fill_tree(tree, GRID_SIZE);
+
+    auto veb = tree.freeze(VEB_LAYOUT);
+    auto bfs = tree.freeze(BFS_LAYOUT);
+
+    printf("tree\tat\tdata_in_region\tchecksum\n");
+    benchmark("live", tree, GRID_SIZE);
+    benchmark("frozen_veb", veb, GRID_SIZE);
+    benchmark("frozen_bfs", bfs, GRID_SIZE);
+
+    return 0;
+}
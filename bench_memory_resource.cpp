@@ -0,0 +1,64 @@
+#include "quadtree.h"
+#include "vec2.h"
+#include <iostream>
+#include <cstdio>
+#include <ctime>
+#include <cstdlib>
+#include <memory_resource>
+
+#define GRID_SIZE 400
+
+using namespace qt;
+
+// Fill benchmark with nodes and buckets taken from different memory resources.
+// Time covers filling the tree and destroying it, a monotonic buffer releases everything at once.
+
+template<typename Tree>
+void fill_tree(Tree &tree, int grid_size) {
+    for (int i = -grid_size; i < grid_size; ++i) {
+        for (int j = -grid_size; j < grid_size; ++j) {
+            tree.insert(Vertex(i, j), 2 * i + 9);
+        }
+    }
+}
+
+template<typename Tree>
+int benchmark(const char *name, int arg, unsigned bucket_size, std::pmr::memory_resource *resource) {
+    clock_t start = clock();
+    // START
+
+    {
+        Tree tree{{0, 0},
+                  {static_cast<long double>(arg), static_cast<long double>(arg)},
+                  bucket_size, 16, false, 0, false, {}, resource};
+        fill_tree(tree, arg);
+    }
+
+    // STOP
+    clock_t stop = clock();
+    double elapsed = (double) (stop - start) / CLOCKS_PER_SEC;
+    printf("%s\t", name);
+    printf("%d\t", 4 * arg * arg);
+    printf("%.5f\n", elapsed);
+    return 0;
+}
+
+int main() {
+    constexpr unsigned bucket_size = 8;
+
+    printf("resource\tpoints\tseconds\n");
+    for (int i = 1; i < GRID_SIZE + 1; i *= 4) {
+        benchmark<QuadTree<int>>("default", i, bucket_size, std::pmr::get_default_resource());
+        benchmark<PmrQuadTree<int>>("new_delete", i, bucket_size, std::pmr::new_delete_resource());
+        {
+            std::pmr::unsynchronized_pool_resource pool;
+            benchmark<PmrQuadTree<int>>("pool", i, bucket_size, &pool);
+        }
+        {
+            std::pmr::monotonic_buffer_resource monotonic;
+            benchmark<PmrQuadTree<int>>("monotonic", i, bucket_size, &monotonic);
+        }
+    }
+
+    return 0;
+}
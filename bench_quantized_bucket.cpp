@@ -0,0 +1,80 @@
+#include "quadtree.h"
+#include "vec2.h"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#define GRID_SIZE 400
+
+using namespace qt;
+
+typedef std::pair<Vertex, int> PairT;
+
+// Heap bytes held by whole trees, nodes and buckets together, after filling them with the same points.
+// Each allocation keeps its size in front of it so that frees can be subtracted.
+static size_t live_bytes = 0;
+
+void *operator new(size_t size) {
+    void *p = std::malloc(size + alignof(std::max_align_t));
+    if (p == nullptr) throw std::bad_alloc();
+    *static_cast<size_t *>(p) = size;
+    live_bytes += size;
+    return static_cast<char *>(p) + alignof(std::max_align_t);
+}
+
+void operator delete(void *p) noexcept {
+    if (p == nullptr) return;
+    p = static_cast<char *>(p) - alignof(std::max_align_t);
+    live_bytes -= *static_cast<size_t *>(p);
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+// Nodes come from the default memory resource, which may ask for their alignment explicitly.
+void *operator new(size_t size, std::align_val_t) {
+    return operator new(size);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+template<typename Tree>
+int benchmark(const char *name, int arg, unsigned bucket_size) {
+    size_t start_bytes = live_bytes;
+    Tree *tree = new Tree{{0, 0},
+                          {static_cast<long double>(arg), static_cast<long double>(arg)},
+                          bucket_size, 16, false};
+    for (int i = -arg; i < arg; ++i) {
+        for (int j = -arg; j < arg; ++j) {
+            tree->insert(Vertex(i, j), 2 * i + 9);
+        }
+    }
+    size_t bytes = live_bytes - start_bytes;
+    printf("%s\t", name);
+    printf("%zu\t", tree->size());
+    printf("%zu\t", bytes);
+    printf("%.1f\n", (double) bytes / tree->size());
+    delete tree;
+    return 0;
+}
+
+int main() {
+    constexpr unsigned bucket_size = 8;
+
+    printf("container\tpoints\tbytes\tbytes_per_point\n");
+    for (int i = 1; i < GRID_SIZE + 1; i *= 4) {
+        benchmark<QuadTree<int>>("vector", i, bucket_size);
+        benchmark<QuadTree<int, PairT, QuantizedBucket<int, uint16_t>>>("quantized16", i, bucket_size);
+        benchmark<QuadTree<int, PairT, QuantizedBucket<int, uint32_t>>>("quantized32", i, bucket_size);
+    }
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "quadtree.h"
+#include "vec2.h"
+#include <iostream>
+#include <cstdio>
+#include <ctime>
+#include <cstdlib>
+#include <new>
+
+#define GRID_SIZE 400
+
+using std::cout;
+using std::cin;
+
+using namespace qt;
+
+typedef std::pair<Vertex, int> PairT;
+
+// Count every heap allocation made while filling the tree, and the ones still held by the tree after it.
+static size_t allocations = 0;
+static size_t deallocations = 0;
+static size_t allocated_bytes = 0;
+
+void *operator new(size_t size) {
+    ++allocations;
+    allocated_bytes += size;
+    void *p = std::malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    if (p != nullptr) ++deallocations;
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    if (p != nullptr) ++deallocations;
+    std::free(p);
+}
+
+template<typename Tree>
+void fill_tree(Tree &tree, int grid_size) {
+    for (int i = -grid_size; i < grid_size; ++i) {
+        for (int j = -grid_size; j < grid_size; ++j) {
+            tree.insert(Vertex(i, j), 2 * i + 9);
+        }
+    }
+}
+
+template<typename Tree>
+int benchmark(const char *name, int arg, unsigned bucket_size) {
+    Tree *tree = new Tree{{0, 0},
+                          {static_cast<long double>(arg), static_cast<long double>(arg)},
+                          bucket_size, 16, false};
+    size_t start_allocations = allocations;
+    size_t start_deallocations = deallocations;
+    size_t start_bytes = allocated_bytes;
+    clock_t start = clock();
+    // START
+
+    fill_tree(*tree, arg);
+
+    // STOP
+    clock_t stop = clock();
+    double elapsed = (double) (stop - start) / CLOCKS_PER_SEC;
+    printf("%s\t", name);
+    printf("%d\t", 4 * arg * arg);
+    printf("%zu\t", allocations - start_allocations);
+    printf("%zu\t", (allocations - start_allocations) - (deallocations - start_deallocations));
+    printf("%zu\t", allocated_bytes - start_bytes);
+    printf("%.5f\n", elapsed);
+    delete tree;
+    return 0;
+}
+
+int main() {
+    constexpr unsigned bucket_size = 8;
+
+    printf("container\tpoints\tallocations\tretained\tbytes\tseconds\n");
+    for (int i = 1; i < GRID_SIZE + 1; i *= 4) {
+        benchmark<QuadTree<int>>("vector", i, bucket_size);
+        benchmark<QuadTree<int, PairT, small_vector<PairT, bucket_size>>>("small_vector", i, bucket_size);
+    }
+
+    return 0;
+}
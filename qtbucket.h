@@ -0,0 +1,507 @@
+#ifndef QUAD_TREE_QTBUCKET_H
+#define QUAD_TREE_QTBUCKET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <array>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "vec2.h"
+
+namespace qt {
+    // Entry of a bucket that doesn't store full pairs. The point is decoded on read, data is still
+    // referenced in place.
+    template<typename DataT>
+    struct bucket_entry {
+        typedef std::pair<Vertex, typename std::remove_const<DataT>::type> value_type;
+
+        Vertex first;
+        DataT &second;
+
+        operator value_type() const {
+            return {first, second};
+        }
+    };
+
+    // Random-access iterator over such a bucket, dereferencing yields the entry returned by bucket[index].
+    template<typename BucketT, typename ReferenceT>
+    class bucket_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef typename std::remove_const<BucketT>::type::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef ReferenceT reference;
+        typedef void pointer;
+
+    private:
+        BucketT *m_bucket;
+        difference_type m_index;
+
+    public:
+        bucket_iterator() : m_bucket(nullptr), m_index(0) {}
+
+        bucket_iterator(BucketT *bucket, difference_type index) : m_bucket(bucket), m_index(index) {}
+
+        // Mutable iterators convert to const ones.
+        template<typename OtherBucketT, typename OtherReferenceT>
+        bucket_iterator(const bucket_iterator<OtherBucketT, OtherReferenceT> &other) :
+                m_bucket(other.bucket()), m_index(other.index()) {}
+
+        BucketT *bucket() const { return m_bucket; }
+
+        difference_type index() const { return m_index; }
+
+        reference operator*() const { return (*m_bucket)[m_index]; }
+
+        reference operator[](difference_type n) const { return (*m_bucket)[m_index + n]; }
+
+        bucket_iterator &operator++() {
+            ++m_index;
+            return *this;
+        }
+
+        bucket_iterator operator++(int) {
+            bucket_iterator tmp(*this);
+            ++m_index;
+            return tmp;
+        }
+
+        bucket_iterator &operator--() {
+            --m_index;
+            return *this;
+        }
+
+        bucket_iterator operator--(int) {
+            bucket_iterator tmp(*this);
+            --m_index;
+            return tmp;
+        }
+
+        bucket_iterator &operator+=(difference_type n) {
+            m_index += n;
+            return *this;
+        }
+
+        bucket_iterator &operator-=(difference_type n) {
+            m_index -= n;
+            return *this;
+        }
+
+        bucket_iterator operator+(difference_type n) const { return {m_bucket, m_index + n}; }
+
+        bucket_iterator operator-(difference_type n) const { return {m_bucket, m_index - n}; }
+
+        difference_type operator-(const bucket_iterator &other) const { return m_index - other.m_index; }
+
+        bool operator==(const bucket_iterator &other) const { return m_index == other.m_index; }
+
+        bool operator!=(const bucket_iterator &other) const { return m_index != other.m_index; }
+
+        bool operator<(const bucket_iterator &other) const { return m_index < other.m_index; }
+
+        bool operator>(const bucket_iterator &other) const { return m_index > other.m_index; }
+
+        bool operator<=(const bucket_iterator &other) const { return m_index <= other.m_index; }
+
+        bool operator>=(const bucket_iterator &other) const { return m_index >= other.m_index; }
+    };
+
+    // Grid shared by the quantized buckets of a tree: its bottom-left corner and the size of a cell.
+    struct QuantizedGrid {
+        Vertex origin;
+        Vertex step;
+    };
+
+    // Trees with the same grid share one object, so that a merge can graft the leaves of the other tree.
+    inline std::shared_ptr<const QuantizedGrid> quantized_grid(const Vertex &origin, const Vertex &step) {
+        static std::mutex mutex;
+        static std::map<std::array<long double, 4>, std::weak_ptr<const QuantizedGrid>> grids;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = grids.begin(); it != grids.end();)
+            it = it->second.expired() ? grids.erase(it) : std::next(it);
+        std::weak_ptr<const QuantizedGrid> &slot = grids[{origin.x, origin.y, step.x, step.y}];
+        std::shared_ptr<const QuantizedGrid> grid = slot.lock();
+        if (grid == nullptr) {
+            grid = std::make_shared<const QuantizedGrid>(QuantizedGrid{origin, step});
+            slot = grid;
+        }
+        return grid;
+    }
+
+    // Bucket container storing points as fixed-width offsets from the bottom-left corner of its leaf,
+    // counted in grid steps of the tree. Points on the grid are stored and read back exactly.
+    // A leaf keeps the grid cell of its corner and a pointer to the grid of the tree.
+    template<typename T, typename OffsetT = uint16_t>
+    class QuantizedBucket {
+    public:
+        typedef std::pair<Vertex, T> value_type;
+        typedef size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef bucket_entry<T> reference;
+        typedef bucket_entry<const T> const_reference;
+        typedef bucket_iterator<QuantizedBucket, reference> iterator;
+        typedef bucket_iterator<const QuantizedBucket, const_reference> const_iterator;
+
+    private:
+        struct slot {
+            OffsetT x;
+            OffsetT y;
+            T data;
+        };
+
+        const QuantizedGrid *m_grid = nullptr;
+        uint64_t m_x = 0;
+        uint64_t m_y = 0;
+        std::vector<slot> m_slots;
+
+        slot encode(const value_type &value) const {
+            Vertex cell = (value.first - m_grid->origin) / m_grid->step;
+            return {(OffsetT) ((uint64_t) cell.x - m_x), (OffsetT) ((uint64_t) cell.y - m_y), value.second};
+        }
+
+    public:
+        // Set by the tree when the leaf is created, before anything is stored. origin is the leaf corner.
+        void frame(const QuantizedGrid *grid, const Vertex &origin) {
+            m_grid = grid;
+            Vertex cell = (origin - grid->origin) / grid->step;
+            m_x = (uint64_t) cell.x;
+            m_y = (uint64_t) cell.y;
+        }
+
+        Vertex point(size_type i) const {
+            return {m_grid->origin.x + m_grid->step.x * (m_x + m_slots[i].x),
+                    m_grid->origin.y + m_grid->step.y * (m_y + m_slots[i].y)};
+        }
+
+        reference operator[](size_type i) {
+            return {point(i), m_slots[i].data};
+        }
+
+        const_reference operator[](size_type i) const {
+            return {point(i), m_slots[i].data};
+        }
+
+        size_type size() const {
+            return m_slots.size();
+        }
+
+        bool empty() const {
+            return m_slots.empty();
+        }
+
+        void clear() {
+            m_slots.clear();
+        }
+
+        iterator begin() { return {this, 0}; }
+
+        iterator end() { return {this, (difference_type) size()}; }
+
+        const_iterator begin() const { return {this, 0}; }
+
+        const_iterator end() const { return {this, (difference_type) size()}; }
+
+        iterator insert(const_iterator pos, const value_type &value) {
+            m_slots.insert(m_slots.begin() + pos.index(), encode(value));
+            return {this, pos.index()};
+        }
+
+        iterator erase(const_iterator pos) {
+            m_slots.erase(m_slots.begin() + pos.index());
+            return {this, pos.index()};
+        }
+    };
+
+    // Bucket container storing only 32-bit indices into a caller-owned point array, with T = uint32_t.
+    // Points are read back through accessor(index), which must return the point the index was inserted at.
+    template<typename AccessorT>
+    class IndexBucket {
+    public:
+        typedef std::pair<Vertex, uint32_t> value_type;
+        typedef size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef bucket_entry<uint32_t> reference;
+        typedef bucket_entry<const uint32_t> const_reference;
+        typedef bucket_iterator<IndexBucket, reference> iterator;
+        typedef bucket_iterator<const IndexBucket, const_reference> const_iterator;
+
+    private:
+        const AccessorT *m_accessor = nullptr;
+        std::vector<uint32_t> m_indices;
+
+    public:
+        // Set by the tree when the leaf is created, before anything is stored.
+        void frame(const AccessorT *accessor) {
+            m_accessor = accessor;
+        }
+
+        Vertex point(size_type i) const {
+            return (*m_accessor)(m_indices[i]);
+        }
+
+        // Indices of the bucket in storage order.
+        const std::vector<uint32_t> &indices() const {
+            return m_indices;
+        }
+
+        reference operator[](size_type i) {
+            return {point(i), m_indices[i]};
+        }
+
+        const_reference operator[](size_type i) const {
+            return {point(i), m_indices[i]};
+        }
+
+        size_type size() const {
+            return m_indices.size();
+        }
+
+        bool empty() const {
+            return m_indices.empty();
+        }
+
+        void clear() {
+            m_indices.clear();
+        }
+
+        iterator begin() { return {this, 0}; }
+
+        iterator end() { return {this, (difference_type) size()}; }
+
+        const_iterator begin() const { return {this, 0}; }
+
+        const_iterator end() const { return {this, (difference_type) size()}; }
+
+        iterator insert(const_iterator pos, const value_type &value) {
+            m_indices.insert(m_indices.begin() + pos.index(), value.second);
+            return {this, pos.index()};
+        }
+
+        iterator erase(const_iterator pos) {
+            m_indices.erase(m_indices.begin() + pos.index());
+            return {this, pos.index()};
+        }
+    };
+
+    // Vector with room for N elements inside the object, it only allocates once it grows past N.
+    // Used as ContainerT, a leaf holding at most N points keeps its bucket inside the node.
+    template<typename ValueT, size_t N>
+    class small_vector {
+        static_assert(N > 0, "small_vector needs inline room for at least one element");
+
+    public:
+        typedef ValueT value_type;
+        typedef ValueT &reference;
+        typedef const ValueT &const_reference;
+        typedef ValueT *iterator;
+        typedef const ValueT *const_iterator;
+        typedef size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+
+    private:
+        ValueT *m_data;
+        size_t m_size;
+        size_t m_capacity;
+        typename std::aligned_storage<sizeof(ValueT), alignof(ValueT)>::type m_inline[N];
+
+        ValueT *inline_data() {
+            return reinterpret_cast<ValueT *>(m_inline);
+        }
+
+        bool is_inline() const {
+            return m_data == reinterpret_cast<const ValueT *>(m_inline);
+        }
+
+        void grow(size_t capacity) {
+            ValueT *data = static_cast<ValueT *>(::operator new(capacity * sizeof(ValueT)));
+            for (size_t i = 0; i < m_size; ++i) {
+                new(data + i) ValueT(std::move(m_data[i]));
+                m_data[i].~ValueT();
+            }
+            if (!is_inline()) ::operator delete(m_data);
+            m_data = data;
+            m_capacity = capacity;
+        }
+
+    public:
+        small_vector() : m_data(inline_data()), m_size(0), m_capacity(N) {}
+
+        small_vector(const small_vector &other) : small_vector() {
+            reserve(other.m_size);
+            for (size_t i = 0; i < other.m_size; ++i)
+                new(m_data + i) ValueT(other.m_data[i]);
+            m_size = other.m_size;
+        }
+
+        small_vector(small_vector &&other) : small_vector() {
+            *this = std::move(other);
+        }
+
+        small_vector &operator=(const small_vector &other) {
+            if (this != &other) {
+                clear();
+                reserve(other.m_size);
+                for (size_t i = 0; i < other.m_size; ++i)
+                    new(m_data + i) ValueT(other.m_data[i]);
+                m_size = other.m_size;
+            }
+            return *this;
+        }
+
+        small_vector &operator=(small_vector &&other) {
+            if (this == &other) return *this;
+            clear();
+            if (other.is_inline()) {
+                for (size_t i = 0; i < other.m_size; ++i)
+                    new(m_data + i) ValueT(std::move(other.m_data[i]));
+                m_size = other.m_size;
+                other.clear();
+            } else {
+                // Steal the heap buffer.
+                if (!is_inline()) ::operator delete(m_data);
+                m_data = other.m_data;
+                m_size = other.m_size;
+                m_capacity = other.m_capacity;
+                other.m_data = other.inline_data();
+                other.m_size = 0;
+                other.m_capacity = N;
+            }
+            return *this;
+        }
+
+        ~small_vector() {
+            clear();
+            if (!is_inline()) ::operator delete(m_data);
+        }
+
+        size_type size() const { return m_size; }
+
+        size_type capacity() const { return m_capacity; }
+
+        bool empty() const { return m_size == 0; }
+
+        reference operator[](size_type i) { return m_data[i]; }
+
+        const_reference operator[](size_type i) const { return m_data[i]; }
+
+        reference back() { return m_data[m_size - 1]; }
+
+        const_reference back() const { return m_data[m_size - 1]; }
+
+        iterator begin() { return m_data; }
+
+        iterator end() { return m_data + m_size; }
+
+        const_iterator begin() const { return m_data; }
+
+        const_iterator end() const { return m_data + m_size; }
+
+        void reserve(size_type capacity) {
+            if (capacity > m_capacity) grow(capacity);
+        }
+
+        void push_back(const value_type &value) {
+            insert(end(), value);
+        }
+
+        void pop_back() {
+            m_data[--m_size].~ValueT();
+        }
+
+        iterator insert(const_iterator pos, const value_type &value) {
+            size_t index = pos - m_data;
+            // Copy first, value may live in this vector.
+            ValueT copy(value);
+            if (m_size == m_capacity) grow(2 * m_capacity);
+            if (index == m_size) {
+                new(m_data + m_size) ValueT(std::move(copy));
+            } else {
+                new(m_data + m_size) ValueT(std::move(m_data[m_size - 1]));
+                std::move_backward(m_data + index, m_data + m_size - 1, m_data + m_size);
+                m_data[index] = std::move(copy);
+            }
+            ++m_size;
+            return m_data + index;
+        }
+
+        iterator erase(const_iterator pos) {
+            size_t index = pos - m_data;
+            std::move(m_data + index + 1, m_data + m_size, m_data + index);
+            m_data[--m_size].~ValueT();
+            return m_data + index;
+        }
+
+        void clear() {
+            for (size_t i = 0; i < m_size; ++i)
+                m_data[i].~ValueT();
+            m_size = 0;
+        }
+    };
+
+    // What the tree needs to know about a bucket container.
+    // offset_bits is the width of stored coordinates, 0 for containers storing full Vertex.
+    // context_type is handed to the tree constructor and passed to every new leaf by frame(). context() gives
+    // the context the tree keeps from the one given and the grid of the tree.
+    template<typename ContainerT>
+    struct bucket_traits {
+        typedef std::nullptr_t context_type;
+
+        static const unsigned offset_bits = 0;
+
+        static context_type context(context_type given, const Vertex &, const Vertex &) { return given; }
+
+        static void frame(ContainerT &, const Vertex &, const Vertex &, context_type) {}
+    };
+
+    template<typename T, typename OffsetT>
+    struct bucket_traits<QuantizedBucket<T, OffsetT>> {
+        typedef std::shared_ptr<const QuantizedGrid> context_type;
+
+        static const unsigned offset_bits = 8 * sizeof(OffsetT);
+
+        static context_type context(const context_type &, const Vertex &origin, const Vertex &step) {
+            return quantized_grid(origin, step);
+        }
+
+        static void frame(QuantizedBucket<T, OffsetT> &bucket, const Vertex &origin, const Vertex &,
+                          const context_type &grid) {
+            bucket.frame(grid.get(), origin);
+        }
+    };
+
+    template<typename AccessorT>
+    struct bucket_traits<IndexBucket<AccessorT>> {
+        typedef const AccessorT *context_type;
+
+        static const unsigned offset_bits = 0;
+
+        static context_type context(context_type given, const Vertex &, const Vertex &) { return given; }
+
+        static void frame(IndexBucket<AccessorT> &bucket, const Vertex &, const Vertex &, context_type accessor) {
+            bucket.frame(accessor);
+        }
+    };
+
+    // Appends the data of every entry of bucket to values.
+    template<typename ContainerT, typename T>
+    void append_values(const ContainerT &bucket, std::vector<T> &values) {
+        for (auto const &entry: bucket)
+            values.push_back(entry.second);
+    }
+
+    // Index buckets copy their indices in one go.
+    template<typename AccessorT>
+    void append_values(const IndexBucket<AccessorT> &bucket, std::vector<uint32_t> &values) {
+        values.insert(values.end(), bucket.indices().begin(), bucket.indices().end());
+    }
+}
+
+#endif //QUAD_TREE_QTBUCKET_H
@@ -0,0 +1,200 @@
+#include "qtproto.h"
+#include "vec2.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace qt;
+
+// Load generator for qtserver. Every thread opens its own connection and sends batches of one op
+// for the given number of seconds, then prints queries per second and batch latency percentiles in microseconds.
+// Results are read from the shared point array so that the zero-copy path is measured too.
+
+static const char *op_names[] = {"at", "data_in_region", "nearest"};
+
+struct Worker {
+    std::vector<uint32_t> latencies;
+    size_t queries = 0;
+    size_t points = 0;
+    double checksum = 0;
+    bool failed = false;
+};
+
+static double percentile(std::vector<uint32_t> &samples, double p) {
+    if (samples.empty()) return 0;
+    size_t index = std::min(samples.size() - 1, (size_t) (p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+static int connect_to(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (fd >= 0 && connect(fd, (sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void run(const char *path, proto_op op, uint32_t batch, double region_size, double seconds,
+                unsigned seed, Worker &worker) {
+    int fd = connect_to(path);
+    ProtoHello hello{};
+    int points_fd = fd < 0 ? -1 : receive_with_fd(fd, &hello, sizeof(hello));
+    if (points_fd < 0 || hello.magic != proto_magic || hello.point_size != sizeof(ProtoPoint)) {
+        worker.failed = true;
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    size_t size = std::max<size_t>(1, hello.count * sizeof(ProtoPoint));
+    void *memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, points_fd, 0);
+    close(points_fd);
+    if (memory == MAP_FAILED) {
+        worker.failed = true;
+        close(fd);
+        return;
+    }
+    const ProtoPoint *points = static_cast<const ProtoPoint *>(memory);
+
+    std::mt19937_64 random(seed);
+    std::uniform_real_distribution<double> x(hello.center[0] - hello.range[0], hello.center[0] + hello.range[0]);
+    std::uniform_real_distribution<double> y(hello.center[1] - hello.range[1], hello.center[1] + hello.range[1]);
+    unsigned arity = proto_arity(op);
+    std::vector<double> coordinates((size_t) batch * arity);
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> runs;
+
+    auto stop = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        if (start >= stop) break;
+
+        for (uint32_t q = 0; q < batch; ++q) {
+            double *c = &coordinates[(size_t) q * arity];
+            if (op == PROTO_AT && hello.count > 0) {
+                // Half of the lookups hit a stored point.
+                const ProtoPoint &point = points[random() % hello.count];
+                c[0] = random() & 1 ? (double) point.first.x : x(random);
+                c[1] = (double) point.first.y;
+            } else {
+                c[0] = x(random);
+                c[1] = y(random);
+            }
+            if (op == PROTO_REGION) {
+                c[2] = c[0] + region_size;
+                c[3] = c[1] + region_size;
+            }
+        }
+
+        ProtoRequest request{op, {}, batch};
+        ProtoReply reply{};
+        if (!write_all(fd, &request, sizeof(request)) ||
+            !write_all(fd, coordinates.data(), coordinates.size() * sizeof(double)) ||
+            !read_all(fd, &reply, sizeof(reply))) {
+            worker.failed = true;
+            break;
+        }
+        // Each query has at most one run per stored point.
+        if (reply.queries != batch || reply.runs > (uint64_t) batch * hello.count) {
+            worker.failed = true;
+            break;
+        }
+        counts.resize(reply.queries);
+        runs.resize((size_t) reply.runs * 2);
+        if (!read_all(fd, counts.data(), counts.size() * sizeof(uint32_t)) ||
+            !read_all(fd, runs.data(), runs.size() * sizeof(uint32_t))) {
+            worker.failed = true;
+            break;
+        }
+
+        // Runs index the shared array, one outside of it is a broken reply.
+        bool valid = true;
+        for (size_t r = 0; r < runs.size(); r += 2)
+            valid = valid && runs[r] <= runs[r + 1] && runs[r + 1] <= hello.count;
+        if (!valid) {
+            worker.failed = true;
+            break;
+        }
+
+        for (size_t r = 0; r < runs.size(); r += 2) {
+            for (uint32_t i = runs[r]; i < runs[r + 1]; ++i)
+                worker.checksum += (double) points[i].second;
+            worker.points += runs[r + 1] - runs[r];
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        worker.latencies.push_back((uint32_t) std::min<int64_t>(elapsed.count(), UINT32_MAX));
+        worker.queries += batch;
+    }
+
+    munmap(memory, size);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s socket_path at|region|nearest [threads] [batch] [seconds] [region_size]\n", argv[0]);
+        return 1;
+    }
+
+    proto_op op;
+    if (strcmp(argv[2], "at") == 0) op = PROTO_AT;
+    else if (strcmp(argv[2], "region") == 0) op = PROTO_REGION;
+    else if (strcmp(argv[2], "nearest") == 0) op = PROTO_NEAREST;
+    else {
+        fprintf(stderr, "unknown op %s\n", argv[2]);
+        return 1;
+    }
+    unsigned threads = argc > 3 ? (unsigned) atoi(argv[3]) : 1;
+    uint32_t batch = argc > 4 ? (uint32_t) atoi(argv[4]) : 64;
+    double seconds = argc > 5 ? atof(argv[5]) : 5;
+    double region_size = argc > 6 ? atof(argv[6]) : 10;
+    if (batch == 0 || batch > proto_max_batch) {
+        fprintf(stderr, "batch must be between 1 and %u\n", proto_max_batch);
+        return 1;
+    }
+
+    std::vector<Worker> workers(threads);
+    std::vector<std::thread> running;
+    for (unsigned t = 0; t < threads; ++t)
+        running.emplace_back(run, argv[1], op, batch, region_size, seconds, t + 1, std::ref(workers[t]));
+    for (std::thread &thread: running) thread.join();
+
+    std::vector<uint32_t> latencies;
+    size_t queries = 0, points = 0;
+    double checksum = 0;
+    for (Worker &worker: workers) {
+        if (worker.failed) {
+            fprintf(stderr, "a connection to %s failed\n", argv[1]);
+            return 1;
+        }
+        latencies.insert(latencies.end(), worker.latencies.begin(), worker.latencies.end());
+        queries += worker.queries;
+        points += worker.points;
+        checksum += worker.checksum;
+    }
+
+    printf("op\tthreads\tbatch\tqps\tpoints/query\tp50_us\tp90_us\tp99_us\n");
+    printf("%s\t%u\t%u\t", op_names[op], threads, batch);
+    printf("%.0f\t", queries / seconds);
+    printf("%.2f\t", queries == 0 ? 0 : (double) points / queries);
+    printf("%.0f\t", percentile(latencies, 0.5));
+    printf("%.0f\t", percentile(latencies, 0.9));
+    printf("%.0f\n", percentile(latencies, 0.99));
+    fprintf(stderr, "checksum %.0f\n", checksum);
+    return 0;
+}
@@ -1,13 +1,110 @@
 #ifndef QUAD_TREE_QTNODE_H
 #define QUAD_TREE_QTNODE_H
 
+#include <cstdint>
+#include <limits>
+#include <atomic>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
 namespace qt {
-    template<typename T, typename PairT, typename ContainerT>
+    // Per-node aggregates. An aggregate is a monoid over the data stored in a subtree:
+    // identity() is the neutral value, lift() maps one entry and combine() must be associative.
+
+    template<typename T>
+    struct NoAggregate {
+        struct value_type {
+        };
+
+        static value_type identity() { return {}; }
+
+        static value_type lift(const Vertex &, const T &) { return {}; }
+
+        static value_type combine(const value_type &, const value_type &) { return {}; }
+    };
+
+    template<typename T>
+    struct SumAggregate {
+        typedef T value_type;
+
+        static value_type identity() { return T(); }
+
+        static value_type lift(const Vertex &, const T &data) { return data; }
+
+        static value_type combine(const value_type &lhs, const value_type &rhs) { return lhs + rhs; }
+    };
+
+    template<typename T>
+    struct MinAggregate {
+        typedef T value_type;
+
+        static value_type identity() { return std::numeric_limits<T>::max(); }
+
+        static value_type lift(const Vertex &, const T &data) { return data; }
+
+        static value_type combine(const value_type &lhs, const value_type &rhs) { return std::min(lhs, rhs); }
+    };
+
+    template<typename T>
+    struct MaxAggregate {
+        typedef T value_type;
+
+        static value_type identity() { return std::numeric_limits<T>::lowest(); }
+
+        static value_type lift(const Vertex &, const T &data) { return data; }
+
+        static value_type combine(const value_type &lhs, const value_type &rhs) { return std::max(lhs, rhs); }
+    };
+
+    // Earliest and latest expiry over a subtree, for data with an expiry member. Required by QuadTree::expire().
+    template<typename T>
+    struct ExpiryAggregate {
+        typedef decltype(T::expiry) time_type;
+
+        struct value_type {
+            time_type earliest;
+            time_type latest;
+        };
+
+        static value_type identity() {
+            return {std::numeric_limits<time_type>::max(), std::numeric_limits<time_type>::lowest()};
+        }
+
+        static value_type lift(const Vertex &, const T &data) { return {data.expiry, data.expiry}; }
+
+        static value_type combine(const value_type &lhs, const value_type &rhs) {
+            return {std::min(lhs.earliest, rhs.earliest), std::max(lhs.latest, rhs.latest)};
+        }
+    };
+
+    // Trees with an ExpiryAggregate can expire(), which a trace cannot replay.
+    template<typename AggregateT>
+    struct is_expiry_aggregate : std::false_type {
+    };
+
+    template<typename T>
+    struct is_expiry_aggregate<ExpiryAggregate<T>> : std::true_type {
+    };
+
+    // Data with an expiry time, for use with ExpiryAggregate.
+    template<typename T, typename TimeT = int64_t>
+    struct Expiring {
+        T value;
+        TimeT expiry;
+    };
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
     class QuadTree;
 
-    template<typename T, typename PairT = std::pair<Vertex, T>, typename ContainerT = std::vector<PairT>>
+    template<typename T, typename PairT = std::pair<Vertex, T>, typename ContainerT = std::vector<PairT>,
+            typename AggregateT = NoAggregate<T>>
     class QuadTreeNode {
-        friend class QuadTree<T, PairT, ContainerT>;
+        template<typename, typename, typename, typename, typename>
+        friend class QuadTree;
+
+    public:
+        typedef typename AggregateT::value_type aggregate_type;
 
     protected:
         Vertex m_center;
@@ -15,19 +112,140 @@ namespace qt {
         QuadTreeNode *m_parent;
         QuadTreeNode *m_children[4];
         bool m_leaf;
+        unsigned m_depth;
         ContainerT m_bucket{};
+        size_t m_count;
+        aggregate_type m_aggregate;
+        std::atomic<unsigned> m_refs;
+        // Sequence counter for optimistic readers, odd while the writer is changing the node.
+        std::atomic<unsigned> m_seq;
+        std::pmr::memory_resource *m_resource;
+
+        // Buckets with a polymorphic allocator draw from the node's resource, other containers ignore it.
+        static constexpr bool bucket_uses_resource = std::uses_allocator<ContainerT, std::pmr::memory_resource *>::value;
+
+        static ContainerT make_bucket(std::pmr::memory_resource *resource) {
+            if constexpr (bucket_uses_resource)
+                return ContainerT(resource);
+            else
+                return ContainerT();
+        }
+
+        static ContainerT copy_bucket(const ContainerT &bucket, std::pmr::memory_resource *resource) {
+            if constexpr (bucket_uses_resource)
+                return ContainerT(bucket, resource);
+            else
+                return ContainerT(bucket);
+        }
 
     public:
-        QuadTreeNode<T>(const Vertex &center, const Vertex &range, QuadTreeNode<T> *parent = nullptr) :
-                m_center{center}, m_range{range}, m_leaf{true} {
+        QuadTreeNode(const Vertex &center, const Vertex &range, QuadTreeNode *parent = nullptr, unsigned depth = 0,
+                     std::pmr::memory_resource *resource = std::pmr::new_delete_resource()) :
+                m_center{center}, m_range{range}, m_leaf{true}, m_depth{depth}, m_bucket(make_bucket(resource)),
+                m_count{0}, m_aggregate(AggregateT::identity()), m_refs{1}, m_seq{0}, m_resource{resource} {
             this->m_parent = parent;
             for (auto &c: m_children) c = nullptr;
         }
 
+        // Copy on write, the copy shares the children of other. It is unlinked, the owning tree sets its parent.
+        QuadTreeNode(const QuadTreeNode &other) :
+                m_center{other.m_center}, m_range{other.m_range}, m_parent{nullptr}, m_leaf{other.m_leaf},
+                m_depth{other.m_depth}, m_bucket(copy_bucket(other.m_bucket, other.m_resource)),
+                m_count{other.m_count}, m_aggregate(other.m_aggregate), m_refs{1}, m_seq{0}, m_resource{other.m_resource} {
+            for (int i = 0; i < 4; ++i) {
+                m_children[i] = other.m_children[i];
+                if (m_children[i] != nullptr) m_children[i]->retain();
+            }
+        }
+
+        QuadTreeNode &operator=(const QuadTreeNode &) = delete;
+
         ~QuadTreeNode() {
-            for (auto &c: m_children) delete c;
+            // A child still held by a copy of this node must not keep a link to freed memory. The link is dropped
+            // before the release, which orders it before the owning tree can see the child unshared.
+            for (auto &c: m_children) {
+                if (c != nullptr && c->m_parent == this) c->m_parent = nullptr;
+                release(c);
+            }
+        }
+
+        // Nodes are allocated from a memory resource, a copy lives in the same resource as its original.
+
+        static QuadTreeNode *create(const Vertex &center, const Vertex &range, QuadTreeNode *parent, unsigned depth,
+                                    std::pmr::memory_resource *resource) {
+            void *memory = resource->allocate(sizeof(QuadTreeNode), alignof(QuadTreeNode));
+            return new(memory) QuadTreeNode(center, range, parent, depth, resource);
+        }
+
+        static QuadTreeNode *clone(const QuadTreeNode &other) {
+            void *memory = other.m_resource->allocate(sizeof(QuadTreeNode), alignof(QuadTreeNode));
+            return new(memory) QuadTreeNode(other);
+        }
+
+        static void destroy(QuadTreeNode *node) {
+            std::pmr::memory_resource *resource = node->m_resource;
+            node->~QuadTreeNode();
+            resource->deallocate(node, sizeof(QuadTreeNode), alignof(QuadTreeNode));
+        }
+
+        // Reference counting, a node is shared by every tree version that can reach it.
+
+        void retain() {
+            m_refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static void release(QuadTreeNode *node) {
+            if (node != nullptr && node->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                destroy(node);
+        }
+
+        bool is_shared() const {
+            return m_refs.load(std::memory_order_acquire) > 1;
+        }
+
+        // Seqlock with a single writer. A reader copies what it needs between begin_read() and validate()
+        // and starts over when validate() fails.
+
+        void begin_write() {
+            m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
         }
 
+        void end_write() {
+            m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        unsigned begin_read() const {
+            unsigned seq;
+            while ((seq = m_seq.load(std::memory_order_acquire)) & 1u);
+            return seq;
+        }
+
+        bool validate(unsigned seq) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return m_seq.load(std::memory_order_relaxed) == seq;
+        }
+
+        // Write section for its lifetime, nested guards on a node already being written do nothing.
+        class WriteGuard {
+        private:
+            QuadTreeNode *m_node;
+
+        public:
+            explicit WriteGuard(QuadTreeNode *node) :
+                    m_node(node->m_seq.load(std::memory_order_relaxed) & 1u ? nullptr : node) {
+                if (m_node != nullptr) m_node->begin_write();
+            }
+
+            WriteGuard(const WriteGuard &) = delete;
+
+            WriteGuard &operator=(const WriteGuard &) = delete;
+
+            ~WriteGuard() {
+                if (m_node != nullptr) m_node->end_write();
+            }
+        };
+
         Vertex center() const {
             return m_center;
         }
@@ -40,18 +258,38 @@ namespace qt {
             return m_parent;
         }
 
-        QuadTreeNode *children() const {
+        QuadTreeNode *const *children() const {
             return m_children;
         }
 
-        ContainerT *&bucket() {
+        QuadTreeNode *child(int direction) const {
+            return m_children[direction];
+        }
+
+        const ContainerT &bucket() const {
             return m_bucket;
         }
 
+        size_t count() const {
+            return m_count;
+        }
+
+        const aggregate_type &aggregate() const {
+            return m_aggregate;
+        }
+
         bool is_leaf() const {
             return m_leaf;
         }
 
+        unsigned depth() const {
+            return m_depth;
+        }
+
+        std::pmr::memory_resource *resource() const {
+            return m_resource;
+        }
+
         void set_parent(QuadTreeNode *&parent_node) {
             m_parent = parent_node;
         }
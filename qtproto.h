@@ -0,0 +1,131 @@
+#ifndef QUAD_TREE_QTPROTO_H
+#define QUAD_TREE_QTPROTO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "vec2.h"
+
+// Protocol of qtserver, for clients on the same host (POSIX only).
+//
+// On connect the server sends a ProtoHello with the file descriptor of a shared memory object attached.
+// It holds the points of the frozen tree as an array of ProtoPoint, which the client maps read-only.
+// A request is a ProtoRequest followed by count queries of its op, two doubles (x, y) for PROTO_AT and
+// PROTO_NEAREST, four (bottom-left x, y, top-right x, y) for PROTO_REGION.
+// The reply is a ProtoReply, then one uint32 per query with the number of runs answering it, then the runs
+// as pairs of uint32 [begin, end) indexing the shared array. Results are never copied, the client reads
+// points where the server stores them. An empty answer is zero runs.
+// A request of more than proto_max_batch queries is a protocol error, the server closes the connection.
+
+namespace qt {
+    static constexpr uint32_t proto_magic = 0x51545331; // "QTS1"
+
+    static constexpr uint32_t proto_max_batch = 1u << 16;
+
+    enum proto_op : uint8_t {
+        PROTO_AT, PROTO_REGION, PROTO_NEAREST
+    };
+
+    // One stored point, the data of a point served by qtserver is its index in the input.
+    typedef std::pair<Vertex, int64_t> ProtoPoint;
+
+    struct ProtoHello {
+        uint32_t magic;
+        uint32_t point_size;
+        uint64_t count;
+        double center[2];
+        double range[2];
+    };
+
+    struct ProtoRequest {
+        uint8_t op;
+        uint8_t reserved[3];
+        uint32_t count;
+    };
+
+    struct ProtoReply {
+        uint32_t queries;
+        uint32_t runs;
+    };
+
+    // Coordinates per query of op.
+    inline unsigned proto_arity(uint8_t op) {
+        return op == PROTO_REGION ? 4 : 2;
+    }
+
+#ifdef MSG_NOSIGNAL
+    // A peer that went away fails the send instead of raising SIGPIPE.
+    static constexpr int proto_send_flags = MSG_NOSIGNAL;
+#else
+    static constexpr int proto_send_flags = 0;
+#endif
+
+    // Blocking socket I/O that retries short transfers, false on error or end of stream.
+
+    inline bool write_all(int fd, const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t n = ::send(fd, p, size, proto_send_flags);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    inline bool read_all(int fd, void *data, size_t size) {
+        char *p = static_cast<char *>(data);
+        while (size > 0) {
+            ssize_t n = ::read(fd, p, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Sends size bytes with a file descriptor attached.
+    inline bool send_with_fd(int socket, const void *data, size_t size, int fd) {
+        iovec io{const_cast<void *>(data), size};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+        return ::sendmsg(socket, &message, proto_send_flags) == (ssize_t) size;
+    }
+
+    // Receives size bytes and the file descriptor sent with them, -1 when none came.
+    inline int receive_with_fd(int socket, void *data, size_t size) {
+        iovec io{data, size};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (::recvmsg(socket, &message, MSG_WAITALL) != (ssize_t) size) return -1;
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header == nullptr || header->cmsg_type != SCM_RIGHTS) return -1;
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        return fd;
+    }
+}
+
+#endif //QUAD_TREE_QTPROTO_H
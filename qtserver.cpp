@@ -0,0 +1,187 @@
+#include "quadtree.h"
+#include "qtproto.h"
+#include "vec2.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace qt;
+
+// Serves at, data_in_region and nearest on a frozen tree to local clients over a Unix domain socket.
+// Points are either random (-n count) or read from a file of "x y" lines (-f path), their data is the line number.
+// The points of the frozen tree are copied once into shared memory, every connection maps them and replies
+// are runs of indices into them, see qtproto.h. One thread per connection, the frozen tree is never written.
+
+typedef QuadTree<int64_t> Tree;
+
+static Tree::frozen_type *frozen = nullptr;
+
+// Shared memory object holding frozen->points(), unlinked at once so it goes away with its last mapping.
+static int share_points(const std::vector<ProtoPoint> &points) {
+    char name[64];
+    snprintf(name, sizeof(name), "/qtserver.%d", (int) getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return -1;
+    shm_unlink(name);
+
+    size_t size = std::max<size_t>(1, points.size() * sizeof(ProtoPoint));
+    if (ftruncate(fd, (off_t) size) != 0) {
+        close(fd);
+        return -1;
+    }
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    std::uninitialized_copy(points.begin(), points.end(), static_cast<ProtoPoint *>(memory));
+    munmap(memory, size);
+    return fd;
+}
+
+static void serve(int client, int points_fd, ProtoHello hello) {
+    std::vector<double> coordinates;
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> runs;
+    const ProtoPoint *base = frozen->points().data();
+
+    if (!send_with_fd(client, &hello, sizeof(hello), points_fd)) {
+        close(client);
+        return;
+    }
+
+    ProtoRequest request{};
+    while (read_all(client, &request, sizeof(request))) {
+        if (request.op > PROTO_NEAREST || request.count > proto_max_batch) break;
+        unsigned arity = proto_arity(request.op);
+        coordinates.resize((size_t) request.count * arity);
+        if (!read_all(client, coordinates.data(), coordinates.size() * sizeof(double))) break;
+
+        counts.assign(request.count, 0);
+        runs.clear();
+        for (uint32_t q = 0; q < request.count; ++q) {
+            const double *c = &coordinates[(size_t) q * arity];
+            const ProtoPoint *point = nullptr;
+            switch (request.op) {
+                case PROTO_AT:
+                    point = frozen->find({c[0], c[1]});
+                    break;
+                case PROTO_NEAREST:
+                    point = frozen->nearest({c[0], c[1]});
+                    break;
+                case PROTO_REGION:
+                    frozen->ranges_in_region({c[0], c[1]}, {c[2], c[3]}, [&](uint32_t begin, uint32_t end) {
+                        runs.push_back(begin);
+                        runs.push_back(end);
+                        ++counts[q];
+                    });
+                    break;
+            }
+            if (point != nullptr) {
+                uint32_t index = (uint32_t) (point - base);
+                runs.push_back(index);
+                runs.push_back(index + 1);
+                counts[q] = 1;
+            }
+        }
+
+        ProtoReply reply{request.count, (uint32_t) (runs.size() / 2)};
+        if (!write_all(client, &reply, sizeof(reply)) ||
+            !write_all(client, counts.data(), counts.size() * sizeof(uint32_t)) ||
+            !write_all(client, runs.data(), runs.size() * sizeof(uint32_t)))
+            break;
+    }
+    close(client);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4 || (strcmp(argv[2], "-n") != 0 && strcmp(argv[2], "-f") != 0)) {
+        fprintf(stderr, "usage: %s socket_path -n count | -f points_file\n", argv[0]);
+        return 1;
+    }
+
+    // Where sends can't suppress SIGPIPE, a client hanging up mid-reply must not end the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<Vertex> input;
+    if (strcmp(argv[2], "-n") == 0) {
+        std::mt19937_64 random(42);
+        std::uniform_real_distribution<double> coordinate(-1000, 1000);
+        size_t count = strtoull(argv[3], nullptr, 10);
+        for (size_t i = 0; i < count; ++i) input.emplace_back(coordinate(random), coordinate(random));
+    } else {
+        FILE *file = fopen(argv[3], "r");
+        if (file == nullptr) {
+            fprintf(stderr, "can't read %s\n", argv[3]);
+            return 1;
+        }
+        double x, y;
+        while (fscanf(file, "%lf %lf", &x, &y) == 2) input.emplace_back(x, y);
+        fclose(file);
+    }
+
+    // Root box covering the input, a square so that nodes stay square.
+    Vertex low{0, 0}, high{0, 0};
+    for (size_t i = 0; i < input.size(); ++i) {
+        if (i == 0 || input[i].x < low.x) low.x = input[i].x;
+        if (i == 0 || input[i].y < low.y) low.y = input[i].y;
+        if (i == 0 || input[i].x > high.x) high.x = input[i].x;
+        if (i == 0 || input[i].y > high.y) high.y = input[i].y;
+    }
+    long double half = std::max(high.x - low.x, high.y - low.y) / 2 + 1;
+    Vertex center{(low.x + high.x) / 2, (low.y + high.y) / 2};
+
+    Tree tree{center, {half, half}, 16, 20};
+    for (size_t i = 0; i < input.size(); ++i) tree.insert(input[i], (int64_t) i);
+    Tree::frozen_type packed = tree.freeze();
+    frozen = &packed;
+
+    int points_fd = share_points(frozen->points());
+    if (points_fd < 0) {
+        perror("shared memory");
+        return 1;
+    }
+    ProtoHello hello{proto_magic, sizeof(ProtoPoint), frozen->size(),
+                     {(double) center.x, (double) center.y}, {(double) half, (double) half}};
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    unlink(argv[1]);
+    if (listener < 0 || bind(listener, (sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(stderr, "serving %zu points on %s\n", frozen->size(), argv[1]);
+
+    for (;;) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // Out of descriptors or memory: wait for connections to close instead of spinning.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                perror("accept");
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+        std::thread(serve, client, points_fd, hello).detach();
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef QUAD_TREE_QTSUBSCRIPTION_H
+#define QUAD_TREE_QTSUBSCRIPTION_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "vec2.h"
+
+namespace qt {
+    // Kind of change a subscription is told about. CHANGE_UPDATE carries the new data.
+    enum change_event {
+        CHANGE_INSERT, CHANGE_REMOVE, CHANGE_UPDATE
+    };
+
+    // Rectangles [bottom_left, top_right) indexed by the quadrants of the tree's root extent. Every rectangle is
+    // kept at the smallest quadrant holding it whole, so a changed point only checks the rectangles on its path
+    // from the root, O(depth + rectangles on the path). Callbacks must not subscribe, unsubscribe or write the tree.
+    template<typename T>
+    class SubscriptionIndex {
+    public:
+        typedef std::function<void(change_event, const Vertex &, const T &)> callback_type;
+
+    private:
+        struct Subscription {
+            size_t id;
+            Vertex bottom_left;
+            Vertex top_right;
+            callback_type callback;
+        };
+
+        struct Quadrant {
+            Quadrant *parent;
+            std::unique_ptr<Quadrant> children[4];
+            std::vector<Subscription> subscriptions;
+
+            explicit Quadrant(Quadrant *parent) : parent(parent) {}
+
+            bool unused() const {
+                return subscriptions.empty() && !children[0] && !children[1] && !children[2] && !children[3];
+            }
+        };
+
+        std::unique_ptr<Quadrant> m_root;
+        std::unordered_map<size_t, Quadrant *> m_owner;
+        Vertex m_center;
+        Vertex m_range;
+        unsigned m_depth = 0;
+        size_t m_next_id = 1;
+
+        // Child numbering of the tree: bit 1 is the top half, bit 2 the right half.
+        static void step(int direction, Vertex &center, Vertex &range) {
+            range = range / 2.0;
+            center.x += direction & 2 ? range.x : -range.x;
+            center.y += direction & 1 ? range.y : -range.y;
+        }
+
+    public:
+        // Quadrants split the box around center down to depth levels.
+        void frame(const Vertex &center, const Vertex &range, unsigned depth) {
+            m_center = center;
+            m_range = range;
+            m_depth = depth;
+        }
+
+        bool empty() const {
+            return m_owner.empty();
+        }
+
+        size_t size() const {
+            return m_owner.size();
+        }
+
+        size_t add(const Vertex &bottom_left, const Vertex &top_right, callback_type callback) {
+            if (!m_root) m_root.reset(new Quadrant(nullptr));
+            Quadrant *quadrant = m_root.get();
+            Vertex center = m_center, range = m_range;
+
+            for (unsigned depth = 0; depth < m_depth; ++depth) {
+                // Half-open rectangles: a rectangle ending at the center line is wholly on its low side.
+                int direction;
+                if (bottom_left.x >= center.x) direction = 2;
+                else if (top_right.x <= center.x) direction = 0;
+                else break;
+                if (bottom_left.y >= center.y) direction |= 1;
+                else if (top_right.y > center.y) break;
+
+                if (!quadrant->children[direction])
+                    quadrant->children[direction].reset(new Quadrant(quadrant));
+                quadrant = quadrant->children[direction].get();
+                step(direction, center, range);
+            }
+
+            size_t id = m_next_id++;
+            quadrant->subscriptions.push_back({id, bottom_left, top_right, std::move(callback)});
+            m_owner.emplace(id, quadrant);
+            return id;
+        }
+
+        bool remove(size_t id) {
+            auto owner = m_owner.find(id);
+            if (owner == m_owner.end()) return false;
+            Quadrant *quadrant = owner->second;
+            m_owner.erase(owner);
+
+            auto &subscriptions = quadrant->subscriptions;
+            for (size_t i = 0; i < subscriptions.size(); ++i) {
+                if (subscriptions[i].id == id) {
+                    subscriptions.erase(subscriptions.begin() + i);
+                    break;
+                }
+            }
+
+            // Drop quadrants nothing is kept in anymore.
+            while (quadrant->parent != nullptr && quadrant->unused()) {
+                Quadrant *parent = quadrant->parent;
+                for (auto &child: parent->children)
+                    if (child.get() == quadrant) child.reset();
+                quadrant = parent;
+            }
+            if (m_owner.empty()) m_root.reset();
+            return true;
+        }
+
+        // Calls every subscription whose rectangle holds point.
+        void notify(change_event event, const Vertex &point, const T &data) const {
+            const Quadrant *quadrant = m_root.get();
+            Vertex center = m_center, range = m_range;
+
+            while (quadrant != nullptr) {
+                for (const Subscription &subscription: quadrant->subscriptions)
+                    if (point.x >= subscription.bottom_left.x && point.x < subscription.top_right.x &&
+                        point.y >= subscription.bottom_left.y && point.y < subscription.top_right.y)
+                        subscription.callback(event, point, data);
+
+                int direction = (point.x >= center.x ? 2 : 0) | (point.y >= center.y ? 1 : 0);
+                quadrant = quadrant->children[direction].get();
+                step(direction, center, range);
+            }
+        }
+    };
+}
+
+#endif //QUAD_TREE_QTSUBSCRIPTION_H
@@ -0,0 +1,207 @@
+#ifndef QUAD_TREE_QTTRACE_H
+#define QUAD_TREE_QTTRACE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <chrono>
+#include <algorithm>
+
+#include "vec2.h"
+
+namespace qt {
+    // Traced operations. TRACE_LOAD is a point that was already in the tree when tracing started, or that a
+    // merge grafted in. TRACE_REMOVE_IF is a multimap remove(point, predicate), recorded with how many entries
+    // it removed.
+    enum trace_op : uint8_t {
+        TRACE_LOAD, TRACE_INSERT, TRACE_REMOVE, TRACE_AT, TRACE_REGION, TRACE_SPLIT_OFF, TRACE_UPDATE,
+        TRACE_REMOVE_IF
+    };
+
+    // Operations recorded with two vertices.
+    inline bool trace_region_op(trace_op op) {
+        return op == TRACE_REGION || op == TRACE_SPLIT_OFF;
+    }
+
+    // Tree configuration, written once at the start of a trace so that a replay can rebuild the tree.
+    struct TraceHeader {
+        Vertex center;
+        Vertex range;
+        uint32_t bucket_size;
+        uint32_t depth;
+        uint32_t grid_bits;
+        uint8_t sort;
+        uint8_t multimap;
+    };
+
+    // One operation read back from a trace. Region operations use both vertices, the others only a.
+    struct TraceEvent {
+        trace_op op;
+        uint32_t nanoseconds;
+        Vertex a;
+        Vertex b;
+        uint32_t count;
+    };
+
+    // Binary trace file. After the magic and the header, every record is the op byte, its duration in
+    // nanoseconds (uint32, saturated) and its vertices, one for a point and two for a region, then for
+    // TRACE_REMOVE_IF the number of entries removed (uint32). Fields are written
+    // one by one in native byte order, without padding. A coordinate is stored as two doubles, its value rounded
+    // to double and the remainder, which keeps the full precision of a long double.
+    // Records are appended through stdio buffering, a writer must not be shared between threads.
+    class TraceWriter {
+    private:
+        static constexpr uint32_t magic = 0x51545232; // "QTR2"
+
+        FILE *m_file;
+        bool m_failed = false;
+
+        template<typename V>
+        void write(const V &value) {
+            if (m_file == nullptr || fwrite(&value, sizeof(value), 1, m_file) != 1) m_failed = true;
+        }
+
+        void write_coordinate(long double c) {
+            double high = (double) c;
+            write(high);
+            write((double) (c - high));
+        }
+
+        void write_vertex(const Vertex &v) {
+            write_coordinate(v.x);
+            write_coordinate(v.y);
+        }
+
+    public:
+        explicit TraceWriter(const char *path) : m_file(fopen(path, "wb")) {}
+
+        TraceWriter(const TraceWriter &) = delete;
+
+        TraceWriter &operator=(const TraceWriter &) = delete;
+
+        ~TraceWriter() {
+            if (m_file != nullptr) fclose(m_file);
+        }
+
+        bool is_open() const {
+            return m_file != nullptr;
+        }
+
+        // False once the file couldn't be opened or a write failed, the trace is incomplete from there on.
+        bool good() const {
+            return m_file != nullptr && !m_failed;
+        }
+
+        bool header(const Vertex &center, const Vertex &range, unsigned bucket_size, unsigned depth,
+                    bool sort, unsigned grid_bits, bool multimap) {
+            write(magic);
+            write_vertex(center);
+            write_vertex(range);
+            write((uint32_t) bucket_size);
+            write((uint32_t) depth);
+            write((uint32_t) grid_bits);
+            write((uint8_t) sort);
+            write((uint8_t) multimap);
+            return good();
+        }
+
+        void record(trace_op op, std::chrono::nanoseconds elapsed, const Vertex &a, const Vertex *b = nullptr,
+                    uint32_t count = 0) {
+            uint32_t nanoseconds = (uint32_t) std::min<int64_t>(elapsed.count(), UINT32_MAX);
+            write(op);
+            write(nanoseconds);
+            write_vertex(a);
+            if (trace_region_op(op)) write_vertex(*b);
+            if (op == TRACE_REMOVE_IF) write(count);
+        }
+
+        bool flush() {
+            if (m_file == nullptr || fflush(m_file) != 0) m_failed = true;
+            return good();
+        }
+
+        friend class TraceReader;
+    };
+
+    class TraceReader {
+    private:
+        FILE *m_file;
+
+        template<typename V>
+        bool read(V &value) {
+            return fread(&value, sizeof(value), 1, m_file) == 1;
+        }
+
+        bool read_coordinate(long double &c) {
+            double high, low;
+            if (!read(high) || !read(low)) return false;
+            c = (long double) high + low;
+            return true;
+        }
+
+        bool read_vertex(Vertex &v) {
+            return read_coordinate(v.x) && read_coordinate(v.y);
+        }
+
+    public:
+        explicit TraceReader(const char *path) : m_file(fopen(path, "rb")) {}
+
+        TraceReader(const TraceReader &) = delete;
+
+        TraceReader &operator=(const TraceReader &) = delete;
+
+        ~TraceReader() {
+            if (m_file != nullptr) fclose(m_file);
+        }
+
+        // False if the file can't be read or isn't a trace.
+        bool header(TraceHeader &header) {
+            uint32_t magic = 0;
+            return m_file != nullptr && read(magic) && magic == TraceWriter::magic &&
+                   read_vertex(header.center) && read_vertex(header.range) &&
+                   read(header.bucket_size) && read(header.depth) && read(header.grid_bits) &&
+                   read(header.sort) && read(header.multimap);
+        }
+
+        // False at the end of the trace or on a truncated record.
+        bool next(TraceEvent &event) {
+            if (!read(event.op) || !read(event.nanoseconds) || !read_vertex(event.a))
+                return false;
+            if (trace_region_op(event.op) && !read_vertex(event.b)) return false;
+            return event.op != TRACE_REMOVE_IF || read(event.count);
+        }
+    };
+
+    // Times one operation and records it when it goes out of scope. Does nothing without a writer.
+    class TraceScope {
+    private:
+        TraceWriter *m_writer;
+        trace_op m_op;
+        const Vertex *m_a;
+        const Vertex *m_b;
+        uint32_t m_count = 0;
+        std::chrono::steady_clock::time_point m_start;
+
+    public:
+        TraceScope(TraceWriter *writer, trace_op op, const Vertex &a, const Vertex *b = nullptr) :
+                m_writer(writer), m_op(op), m_a(&a), m_b(b) {
+            if (m_writer != nullptr) m_start = std::chrono::steady_clock::now();
+        }
+
+        TraceScope(const TraceScope &) = delete;
+
+        TraceScope &operator=(const TraceScope &) = delete;
+
+        // Entries the operation removed, recorded for TRACE_REMOVE_IF.
+        void count(size_t count) {
+            m_count = (uint32_t) std::min<size_t>(count, UINT32_MAX);
+        }
+
+        ~TraceScope() {
+            if (m_writer != nullptr)
+                m_writer->record(m_op, std::chrono::steady_clock::now() - m_start, *m_a, m_b, m_count);
+        }
+    };
+}
+
+#endif //QUAD_TREE_QTTRACE_H
@@ -3,66 +3,188 @@
 namespace qt {
     // Constructor
 
-    template<typename T, typename PairT, typename ContainerT>
-    QuadTree<T, PairT, ContainerT>::QuadTree(Vertex center, Vertex range, unsigned int bucket_size,
-                                             unsigned int depth, bool sort) {
-        m_root = new Node{center, range};
-        max_depth = depth > 0 ? depth : 16;
-        max_bucket_size = bucket_size > 0 ? bucket_size : 1;
-        m_sort = sort;
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::QuadTree(Vertex center, Vertex range, unsigned int bucket_size,
+                                                         unsigned int depth, bool sort, unsigned int grid_bits,
+                                                         bool multimap,
+                                                         typename bucket_traits<ContainerT>::context_type context,
+                                                         std::pmr::memory_resource *resource) {
+        m_resource = resource != nullptr ? resource : std::pmr::get_default_resource();
+        m_root = Node::create(center, range, nullptr, 0, m_resource);
+        if constexpr (PolicyT::is_static) {
+            max_depth = PolicyT::max_depth;
+            max_bucket_size = PolicyT::bucket_size;
+            m_sort = PolicyT::sort;
+        } else {
+            max_depth = depth > 0 ? depth : 16;
+            max_bucket_size = bucket_size > 0 ? bucket_size : 1;
+            m_sort = sort;
+        }
         m_pair_comp = PairComp();
         m_size = 0;
+        m_trace = nullptr;
+        m_multimap = multimap;
+        // Grid of 2^grid_bits cells per axis over the root, only points on the grid can be inserted.
+        // Quantized buckets turn it on by default and need leaves small enough for their offsets.
+        unsigned offset_bits = bucket_traits<ContainerT>::offset_bits;
+        m_grid_bits = std::min(grid_bits > 0 ? grid_bits : offset_bits, 64u);
+        m_step = Vertex{std::ldexp(2 * range.x, -(int) m_grid_bits), std::ldexp(2 * range.y, -(int) m_grid_bits)};
+        min_leaf_depth = offset_bits > 0 && m_grid_bits > offset_bits ? m_grid_bits - offset_bits : 0;
+        max_depth = std::max(max_depth, min_leaf_depth);
+        // Cells can't be split further than the grid.
+        if (m_grid_bits > 0) max_depth = std::min(max_depth, m_grid_bits);
+        m_context = bucket_traits<ContainerT>::context(context, m_root->bottom_left(), m_step);
+        frame(m_root);
+        m_subscriptions.frame(center, range, max_depth);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::QuadTree(const QuadTree &other) {
+        m_root = other.m_root;
+        m_root->retain();
+        max_depth = other.max_depth;
+        max_bucket_size = other.max_bucket_size;
+        m_sort = other.m_sort;
+        m_pair_comp = PairComp();
+        m_size = other.m_size;
+        m_grid_bits = other.m_grid_bits;
+        m_multimap = other.m_multimap;
+        m_context = other.m_context;
+        m_resource = other.m_resource;
+        min_leaf_depth = other.min_leaf_depth;
+        m_step = other.m_step;
+        // Snapshots are read from other threads, they don't share the writer.
+        m_trace = nullptr;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::QuadTree(QuadTree &&other) noexcept : QuadTree(other) {
+        // Share everything, then leave other with a fresh root so that no node is shared.
+        Node *root = other.empty_root();
+        Node::release(other.m_root);
+        other.m_root = root;
+        other.m_size = 0;
+        m_trace = other.m_trace;
+        other.m_trace = nullptr;
+        m_subscriptions = std::move(other.m_subscriptions);
+        other.m_subscriptions = SubscriptionIndex<T>();
+        other.m_subscriptions.frame(root->m_center, root->m_range, other.max_depth);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT> &
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::operator=(QuadTree &&other) noexcept {
+        if (&other != this) {
+            // The temporary takes other and releases our old nodes when it goes.
+            QuadTree moved(std::move(other));
+            swap(moved);
+        }
+        return *this;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::swap(QuadTree &other) noexcept {
+        std::swap(m_root, other.m_root);
+        std::swap(max_depth, other.max_depth);
+        std::swap(max_bucket_size, other.max_bucket_size);
+        std::swap(m_sort, other.m_sort);
+        std::swap(m_size, other.m_size);
+        std::swap(m_grid_bits, other.m_grid_bits);
+        std::swap(min_leaf_depth, other.min_leaf_depth);
+        std::swap(m_step, other.m_step);
+        std::swap(m_trace, other.m_trace);
+        std::swap(m_multimap, other.m_multimap);
+        std::swap(m_context, other.m_context);
+        std::swap(m_resource, other.m_resource);
+        std::swap(m_subscriptions, other.m_subscriptions);
     }
 
     // Destructor
 
-    template<typename T, typename PairT, typename ContainerT>
-    QuadTree<T, PairT, ContainerT>::~QuadTree() {
-        delete_children(m_root);
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::~QuadTree() {
+        // Node destructor releases its children, nodes still shared with a snapshot stay alive.
+        Node::release(m_root);
     }
 
     // Class member functions
 
-    template<typename T, typename PairT, typename ContainerT>
-    std::pair<typename QuadTree<T, PairT, ContainerT>::viterator, bool> QuadTree<T, PairT, ContainerT>::insert(
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::pair<typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::viterator, bool> QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::insert(
             const Vertex &point, const T &data) {
+        TraceScope scope(m_trace, TRACE_INSERT, point);
+
         // Bound check
         if (!in_region(point, m_root->bottom_left(), m_root->top_right())) return {};
+        if (m_grid_bits > 0 && !on_grid(point)) return {};
 
-        // Duplicates check
-        if (contains(point)) return {};
+        // Duplicates check, multimap mode keeps every copy.
+        if (!m_multimap && contains(point)) return {};
 
-        auto pit = insert(point, data, m_root, nullptr, 0);
+        auto pit = insert(point, cell(point), data, own(m_root, nullptr), 0);
 
         if (pit.second) {
             ++m_size;
+            if (!m_subscriptions.empty()) m_subscriptions.notify(CHANGE_INSERT, point, data);
             return pit;
         }
         return {};
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    bool QuadTree<T, PairT, ContainerT>::update(const Vertex &point, const T &data) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::pair<typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::viterator, bool>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::insert(viterator hint, const Vertex &point, const T &data) {
+        if (hint.node == nullptr || !in_region(point, m_root->bottom_left(), m_root->top_right()))
+            return insert(point, data);
+
+        // Hint left over from before a snapshot, take the long way with its bound and duplicate checks.
+        Node *start = descend(point, climb(point, hint.node));
+        Node **slot = live_slot(start);
+        if (slot == nullptr) return insert(point, data);
+
+        TraceScope scope(m_trace, TRACE_INSERT, point);
+        if (m_grid_bits > 0 && !on_grid(point)) return {};
+
+        // Duplicates check, a copy of point can only be in start.
+        if (!m_multimap) {
+            for (auto const &entry: start->m_bucket)
+                if (entry.first == point)
+                    return {};
+        }
+
+        auto pit = insert(point, cell(point), data, *slot, start->m_depth);
+        if (!pit.second) return {};
+
+        // Nodes above the start of the descent count the new point too.
+        for (Node *node = (*slot)->m_parent; node != nullptr; node = node->m_parent) {
+            ++node->m_count;
+            node->m_aggregate = AggregateT::combine(node->m_aggregate, AggregateT::lift(point, data));
+        }
+        ++m_size;
+        if (!m_subscriptions.empty()) m_subscriptions.notify(CHANGE_INSERT, point, data);
+        return pit;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::update(const Vertex &point, const T &data) {
         // Bound check
         if (!in_region(point, m_root->bottom_left(), m_root->top_right())) return false;
 
-        if (!contains(point)) {
-            // Return true if there is no point yet and successful insertion.
-            if (insert(point, data, m_root, m_root, 0)) {
-                ++m_size;
-                return true;
-            }
-        }
+        // Return true if there is no point yet and successful insertion. The insert traces itself.
+        if (!contains(point))
+            return insert(point, data).second;
+        TraceScope scope(m_trace, TRACE_UPDATE, point);
 
-        std::stack<Node *> nodes;
-        nodes.push(m_root);
+        PathStack nodes;
+        nodes.push(own(m_root, nullptr));
         Node *top = nodes.top();
+        Cell key = cell(point);
         unsigned dir;
 
         while (!top->m_leaf) {
-            dir = direction(point, top);
+            dir = direction(point, key, top, nodes.size() - 1);
             if (top->m_children[dir]) {
-                nodes.push(top->m_children[dir]);
+                nodes.push(own(top->m_children[dir], top));
                 top = nodes.top();
             } else {
                 return false;
@@ -71,22 +193,28 @@ namespace qt {
 
         for (int i = 0; i < top->m_bucket.size(); ++i)
             if (top->m_bucket[i].first == point) {
-                top->m_bucket[i].second = data;
-                break;
+                {
+                    typename Node::WriteGuard guard(top);
+                    top->m_bucket[i].second = data;
+                }
+                refresh_path(nodes);
+                if (!m_subscriptions.empty()) m_subscriptions.notify(CHANGE_UPDATE, point, data);
+                return true;
             }
         return false;
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    bool QuadTree<T, PairT, ContainerT>::contains(const Vertex &point) {
-        std::stack<Node *> nodes;
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::contains(const Vertex &point) {
+        PathStack nodes;
         nodes.push(m_root);
         Node *top = nodes.top();
+        Cell key = cell(point);
         unsigned dir;
 
         // Find appropriate node (non-recursive loop)
         while (!top->m_leaf) {
-            dir = direction(point, top);
+            dir = direction(point, key, top, nodes.size() - 1);
             if (top->m_children[dir] != nullptr) {
                 nodes.push(top->m_children[dir]);
                 top = nodes.top();
@@ -102,18 +230,112 @@ namespace qt {
         return false;
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    bool QuadTree<T, PairT, ContainerT>::remove(const Vertex &point) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::contains(const Vertex &point, viterator &hint) {
+        Node *node = seek(point, hint);
+
+        for (auto const &entry: node->m_bucket)
+            if (entry.first == point)
+                return true;
+        return false;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::read_at(const Vertex &point, T &data) const {
+        return read_point(point, &data);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::read_contains(const Vertex &point) const {
+        return read_point(point, nullptr);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::read_point(const Vertex &point, T *data) const {
+        static_assert(std::is_trivially_copyable<T>::value, "optimistic reads copy T while it may be written");
+        Cell key = cell(point);
+        Node *node = m_root;
+
+        while (true) {
+            unsigned seq = node->begin_read();
+            if (!node->m_leaf) {
+                Node *child = node->m_children[direction(point, key, node, node->m_depth)];
+                if (!node->validate(seq)) continue;
+                if (child == nullptr) return false;
+                node = child;
+                continue;
+            }
+
+            bool found = false;
+            T copy{};
+            for (size_t i = 0; i < node->m_bucket.size(); ++i) {
+                if (node->m_bucket[i].first == point) {
+                    copy = node->m_bucket[i].second;
+                    found = true;
+                    break;
+                }
+            }
+            // Retry the same node, a leaf that was split meanwhile is read as a stem.
+            if (!node->validate(seq)) continue;
+            if (found && data != nullptr) *data = copy;
+            return found;
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<std::pair<Vertex, T>>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::read_data_in_region(const Vertex &bottom_left,
+                                                                    const Vertex &top_right) const {
+        static_assert(std::is_trivially_copyable<T>::value, "optimistic reads copy T while it may be written");
+        std::vector<std::pair<Vertex, T>> results{};
         std::stack<Node *> nodes;
         nodes.push(m_root);
+
+        while (!nodes.empty()) {
+            Node *top = nodes.top();
+            nodes.pop();
+            // Boxes never change, only contents are read under the counter.
+            if (status(top->m_center, top->m_range, bottom_left, top_right) == OUT_OF_BOUND) continue;
+
+            while (true) {
+                size_t mark = results.size();
+                unsigned seq = top->begin_read();
+                if (top->m_leaf) {
+                    for (size_t i = 0; i < top->m_bucket.size(); ++i) {
+                        std::pair<Vertex, T> entry = top->m_bucket[i];
+                        if (in_region(entry.first, bottom_left, top_right))
+                            results.push_back(entry);
+                    }
+                    if (top->validate(seq)) break;
+                    results.erase(results.begin() + mark, results.end());
+                } else {
+                    Node *children[4];
+                    std::copy(top->m_children, top->m_children + 4, children);
+                    if (!top->validate(seq)) continue;
+                    for (Node *child: children)
+                        if (child != nullptr)
+                            nodes.push(child);
+                    break;
+                }
+            }
+        }
+        return results;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::remove(const Vertex &point) {
+        TraceScope scope(m_trace, TRACE_REMOVE, point);
+        PathStack nodes;
+        nodes.push(own(m_root, nullptr));
         Node *top = nodes.top();
+        Cell key = cell(point);
         unsigned dir;
 
         // Find appropriate node (non-recursive loop)
         while (!top->m_leaf) {
-            dir = direction(point, top);
+            dir = direction(point, key, top, nodes.size() - 1);
             if (top->m_children[dir] != nullptr) {
-                nodes.push(top->m_children[dir]);
+                nodes.push(own(top->m_children[dir], top));
                 top = nodes.top();
             } else {
                 return false;
@@ -123,19 +345,164 @@ namespace qt {
         // Find that point and delete nodes.
         for (int i = 0; i < top->m_bucket.size(); ++i) {
             if (top->m_bucket[i].first == point) {
-                top->m_bucket.erase(top->m_bucket.begin() + i);
+                // The entry is gone after the erase, subscribers get a copy of its data.
+                std::optional<T> removed;
+                if (!m_subscriptions.empty()) removed.emplace(top->m_bucket[i].second);
+                {
+                    typename Node::WriteGuard guard(top);
+                    top->m_bucket.erase(top->m_bucket.begin() + i);
+                }
+                refresh_path(nodes);
                 reduce(nodes);
                 --m_size;
+                if (removed) m_subscriptions.notify(CHANGE_REMOVE, point, *removed);
                 return true;
             }
         }
         return false;
     }
 
-    template<typename T, typename PairT, typename ContainerT>
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    template<typename Predicate>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::remove(const Vertex &point, Predicate predicate) {
+        TraceScope scope(m_trace, TRACE_REMOVE_IF, point);
+        PathStack nodes;
+        nodes.push(own(m_root, nullptr));
+        Node *top = nodes.top();
+        Cell key = cell(point);
+        unsigned dir;
+
+        while (!top->m_leaf) {
+            dir = direction(point, key, top, nodes.size() - 1);
+            if (top->m_children[dir] != nullptr) {
+                nodes.push(own(top->m_children[dir], top));
+                top = nodes.top();
+            } else {
+                return 0;
+            }
+        }
+
+        size_t removed = 0;
+        std::vector<T> notified;
+        for (size_t i = 0; i < top->m_bucket.size();) {
+            if (top->m_bucket[i].first == point && predicate(top->m_bucket[i].second)) {
+                if (!m_subscriptions.empty()) notified.push_back(top->m_bucket[i].second);
+                typename Node::WriteGuard guard(top);
+                top->m_bucket.erase(top->m_bucket.begin() + i);
+                ++removed;
+            } else {
+                ++i;
+            }
+        }
+        scope.count(removed);
+        if (removed > 0) {
+            refresh_path(nodes);
+            reduce(nodes);
+            m_size -= removed;
+        }
+        for (const T &data: notified)
+            m_subscriptions.notify(CHANGE_REMOVE, point, data);
+        return removed;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    template<typename TimeT>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::expire(const TimeT &now) {
+        size_t removed = expire(m_root, nullptr, now);
+        m_size -= removed;
+        return removed;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    template<typename TimeT>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::expire(Node *&node, Node *parent, const TimeT &now) {
+        // Nothing stale below.
+        if (!(node->m_aggregate.earliest <= now)) return 0;
+
+        // Everything below is stale, the whole subtree goes at once.
+        if (node->m_aggregate.latest <= now && node != m_root) {
+            size_t removed = node->m_count;
+            Node::release(node);
+            node = nullptr;
+            return removed;
+        }
+
+        Node *top = own(node, parent);
+        typename Node::WriteGuard guard(top);
+        size_t removed = 0;
+        for (size_t i = 0; i < top->m_bucket.size();) {
+            if (top->m_bucket[i].second.expiry <= now) {
+                top->m_bucket.erase(top->m_bucket.begin() + i);
+                ++removed;
+            } else {
+                ++i;
+            }
+        }
+        for (Node *&child: top->m_children)
+            if (child != nullptr)
+                removed += expire(child, top, now);
+
+        // Children are done, so merging on the way up is a single reduce pass over the visited nodes.
+        refresh_aggregate(top);
+        if (!top->m_leaf) collapse(top);
+        return removed;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<T *> QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::equal_range(const Vertex &point) {
+        std::vector<T *> results;
+        Node *leaf = descend(point, m_root);
+        for (size_t i = 0; i < leaf->m_bucket.size(); ++i)
+            if (leaf->m_bucket[i].first == point)
+                results.push_back(&leaf->m_bucket[i].second);
+        return results;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::count(const Vertex &point) {
+        Node *leaf = descend(point, m_root);
+        size_t count = 0;
+        for (size_t i = 0; i < leaf->m_bucket.size(); ++i)
+            count += leaf->m_bucket[i].first == point;
+        return count;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
     std::vector<std::pair<Vertex, T>>
-    QuadTree<T, PairT, ContainerT>::data_in_region(const Vertex &bottom_left, const Vertex &top_right) {
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::data_in_region(const Vertex &bottom_left, const Vertex &top_right,
+                                                               traversal order) {
+        TraceScope scope(m_trace, TRACE_REGION, bottom_left, &top_right);
         std::vector<std::pair<Vertex, T>> results{};
+
+        if (order != ANY_ORDER) {
+            // Depth-first walk along the curve, the order of children is chosen per node while descending.
+            CurveStack ordered;
+            ordered.push({m_root, 0});
+
+            while (!ordered.empty()) {
+                Node *top = ordered.top().first;
+                int state = ordered.top().second;
+                ordered.pop();
+
+                switch (status(top->m_center, top->m_range, bottom_left, top_right)) {
+                    case IN_BOUND:
+                        add_points_to_result(top, state, order, results);
+                        break;
+
+                    case PARTIAL_BOUND:
+                        for (auto const &entry: top->m_bucket)
+                            if (in_region(entry.first, bottom_left, top_right))
+                                results.push_back(entry);
+                        push_children(ordered, top, state, order);
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+            return results;
+        }
+
         std::queue<Node *> nodes;
         nodes.push(m_root);
 
@@ -186,8 +553,473 @@ namespace qt {
         return results;
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    Vertex QuadTree<T, PairT, ContainerT>::new_center(int direction, QuadTree::Node *node) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<T> QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::values_in_region(const Vertex &bottom_left,
+                                                                                   const Vertex &top_right) {
+        TraceScope scope(m_trace, TRACE_REGION, bottom_left, &top_right);
+        std::vector<T> results{};
+        // Second is true for nodes already known to be enclosed.
+        std::stack<std::pair<Node *, bool>> nodes;
+        nodes.push({m_root, false});
+
+        while (!nodes.empty()) {
+            Node *top = nodes.top().first;
+            bool enclosed = nodes.top().second;
+            nodes.pop();
+
+            if (!enclosed) {
+                switch (status(top->m_center, top->m_range, bottom_left, top_right)) {
+                    case IN_BOUND:
+                        enclosed = true;
+                        break;
+
+                    case PARTIAL_BOUND:
+                        for (auto const &entry: top->m_bucket)
+                            if (in_region(entry.first, bottom_left, top_right))
+                                results.push_back(entry.second);
+                        break;
+
+                    default:
+                        continue;
+                }
+            }
+            if (enclosed) append_values(top->m_bucket, results);
+
+            for (Node *child: top->m_children)
+                if (child != nullptr)
+                    nodes.push({child, enclosed});
+        }
+        return results;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<std::pair<Vertex, T>>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::data_in_polygon(const Polygon &polygon) {
+        std::vector<std::pair<Vertex, T>> results{};
+        std::stack<Node *> nodes;
+        nodes.push(m_root);
+
+        while (!nodes.empty()) {
+            Node *top = nodes.top();
+            nodes.pop();
+
+            switch (polygon.status(top->bottom_left(), top->top_right())) {
+                case IN_BOUND:
+                    add_points_to_result(top, results);
+                    break;
+
+                case PARTIAL_BOUND:
+                    for (auto const &entry: top->m_bucket)
+                        if (polygon.contains(entry.first))
+                            results.push_back(entry);
+                    for (Node *child: top->m_children)
+                        if (child != nullptr)
+                            nodes.push(child);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+        return results;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<std::pair<Vertex, T>>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::data_in_polygon(const std::vector<Vertex> &polygon) {
+        return data_in_polygon(Polygon(polygon));
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::count_in_region(const Vertex &bottom_left,
+                                                                       const Vertex &top_right) {
+        return count_in_region(m_root, bottom_left, top_right);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::count_in_region(Node *node, const Vertex &bottom_left,
+                                                                       const Vertex &top_right) {
+        size_t count = 0;
+        std::stack<Node *> nodes;
+        nodes.push(node);
+
+        while (!nodes.empty()) {
+            Node *top = nodes.top();
+            nodes.pop();
+
+            switch (status(top->m_center, top->m_range, bottom_left, top_right)) {
+                case IN_BOUND:
+                    // Whole subtree is enclosed, use its stored count.
+                    count += top->m_count;
+                    break;
+
+                case PARTIAL_BOUND:
+                    for (auto const &entry: top->m_bucket)
+                        count += in_region(entry.first, bottom_left, top_right);
+                    for (Node *child: top->m_children)
+                        if (child != nullptr)
+                            nodes.push(child);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+        return count;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    CountEstimate QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::estimate_count(const Vertex &bottom_left,
+                                                                             const Vertex &top_right,
+                                                                             size_t max_nodes) {
+        CountEstimate estimate{0, 0, 0};
+        double interpolated = 0;
+
+        // A node left crossing the region holds between none and all of its points inside it,
+        // they are assumed to be spread evenly over its area.
+        auto interpolate = [&](Node *node) {
+            Vertex bl = node->bottom_left(), tr = node->top_right();
+            long double width = std::min(tr.x, top_right.x) - std::max(bl.x, bottom_left.x);
+            long double height = std::min(tr.y, top_right.y) - std::max(bl.y, bottom_left.y);
+            long double fraction = (width * height) / (4 * node->m_range.x * node->m_range.y);
+            interpolated += (double) (node->m_count * std::max(0.0L, std::min(fraction, 1.0L)));
+            estimate.high += node->m_count;
+        };
+
+        // Max-heap of stem nodes crossing the region, the largest count is the largest share of the uncertainty.
+        // Leaves can't be refined without reading their buckets, they are interpolated right away.
+        auto by_count = [](const Node *a, const Node *b) { return a->m_count < b->m_count; };
+        small_vector<Node *, 64> partial;
+        partial.reserve(3 * max_nodes + 1);
+        auto classify = [&](Node *node) {
+            switch (status(node->m_center, node->m_range, bottom_left, top_right)) {
+                case IN_BOUND:
+                    estimate.low += node->m_count;
+                    estimate.high += node->m_count;
+                    break;
+
+                case PARTIAL_BOUND:
+                    if (node->m_count == 0) break;
+                    if (node->m_leaf) {
+                        interpolate(node);
+                        break;
+                    }
+                    partial.push_back(node);
+                    std::push_heap(partial.begin(), partial.end(), by_count);
+                    break;
+
+                default:
+                    break;
+            }
+        };
+
+        classify(m_root);
+        for (size_t expanded = 0; expanded < max_nodes && !partial.empty(); ++expanded) {
+            std::pop_heap(partial.begin(), partial.end(), by_count);
+            Node *top = partial.back();
+            partial.pop_back();
+            for (Node *child: top->m_children)
+                if (child != nullptr)
+                    classify(child);
+        }
+        for (Node *node: partial)
+            interpolate(node);
+
+        estimate.count = estimate.low + interpolated;
+        return estimate;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::aggregate_type
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::aggregate_in_region(const Vertex &bottom_left,
+                                                                    const Vertex &top_right) {
+        aggregate_type aggregate = AggregateT::identity();
+        std::stack<Node *> nodes;
+        nodes.push(m_root);
+
+        while (!nodes.empty()) {
+            Node *top = nodes.top();
+            nodes.pop();
+
+            switch (status(top->m_center, top->m_range, bottom_left, top_right)) {
+                case IN_BOUND:
+                    // Whole subtree is enclosed, use its stored aggregate.
+                    aggregate = AggregateT::combine(aggregate, top->m_aggregate);
+                    break;
+
+                case PARTIAL_BOUND:
+                    for (auto const &entry: top->m_bucket)
+                        if (in_region(entry.first, bottom_left, top_right))
+                            aggregate = AggregateT::combine(aggregate, AggregateT::lift(entry.first, entry.second));
+                    for (Node *child: top->m_children)
+                        if (child != nullptr)
+                            nodes.push(child);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+        return aggregate;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<std::pair<Vertex, T>>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::sample_in_region(const Vertex &bottom_left, const Vertex &top_right,
+                                                                 size_t max_points) {
+        std::vector<std::pair<Vertex, T>> results{};
+        std::queue<std::pair<Node *, size_t>> nodes;
+        nodes.push({m_root, max_points});
+
+        while (!nodes.empty()) {
+            Node *top = nodes.front().first;
+            size_t quota = nodes.front().second;
+            nodes.pop();
+
+            enclosure status = this->status(top->m_center, top->m_range, bottom_left, top_right);
+            if (status == OUT_OF_BOUND || quota == 0) continue;
+
+            // Whole subtree fits in the budget.
+            if (status == IN_BOUND && top->m_count <= quota) {
+                add_points_to_result(top, results);
+                continue;
+            }
+
+            // Leaf node, take evenly spaced points of the bucket.
+            if (top->m_leaf) {
+                std::vector<size_t> matches;
+                for (size_t i = 0; i < top->m_bucket.size(); ++i)
+                    if (in_region(top->m_bucket[i].first, bottom_left, top_right))
+                        matches.push_back(i);
+                size_t taken = std::min(quota, matches.size());
+                for (size_t k = 0; k < taken; ++k)
+                    results.push_back(top->m_bucket[matches[k * matches.size() / taken]]);
+                continue;
+            }
+
+            // Stem node, split the budget between children by their counts inside the region (largest remainder
+            // first). No share exceeds what its child holds in the region, so every share is filled in full and
+            // nothing is lost to children outside of it.
+            size_t counts[4] = {0, 0, 0, 0};
+            size_t weight = 0;
+            for (int i = 0; i < 4; ++i) {
+                Node *child = top->m_children[i];
+                if (child == nullptr) continue;
+                switch (this->status(child->m_center, child->m_range, bottom_left, top_right)) {
+                    case IN_BOUND:
+                        counts[i] = child->m_count;
+                        break;
+                    case PARTIAL_BOUND:
+                        counts[i] = count_in_region(child, bottom_left, top_right);
+                        break;
+                    default:
+                        break;
+                }
+                weight += counts[i];
+            }
+            if (weight == 0) continue;
+            quota = std::min(quota, weight);
+
+            size_t shares[4] = {0, 0, 0, 0};
+            std::pair<size_t, int> remainders[4];
+            size_t given = 0;
+            for (int i = 0; i < 4; ++i) {
+                shares[i] = quota * counts[i] / weight;
+                remainders[i] = {quota * counts[i] % weight, i};
+                given += shares[i];
+            }
+            std::sort(remainders, remainders + 4, std::greater<std::pair<size_t, int>>());
+            for (int i = 0; given < quota && i < 4 && remainders[i].first > 0; ++i, ++given)
+                ++shares[remainders[i].second];
+
+            for (int i = 0; i < 4; ++i)
+                if (shares[i] > 0)
+                    nodes.push({top->m_children[i], shares[i]});
+        }
+        return results;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::rasterize(const Vertex &bottom_left, const Vertex &top_right,
+                                                               unsigned width, unsigned height, size_t *buffer) {
+        std::fill(buffer, buffer + (size_t) width * height, 0);
+        if (width == 0 || height == 0) return;
+
+        Vertex pixel_size{(top_right.x - bottom_left.x) / width, (top_right.y - bottom_left.y) / height};
+        std::stack<Node *> nodes;
+        nodes.push(m_root);
+
+        while (!nodes.empty()) {
+            Node *top = nodes.top();
+            nodes.pop();
+
+            enclosure status = this->status(top->m_center, top->m_range, bottom_left, top_right);
+            if (status == OUT_OF_BOUND || top->m_count == 0) continue;
+
+            if (status == IN_BOUND) {
+                Vertex nodeMin{top->bottom_left()};
+                Vertex nodeMax{top->top_right()};
+                unsigned x0 = pixel(nodeMin.x, bottom_left.x, pixel_size.x, width);
+                unsigned y0 = pixel(nodeMin.y, bottom_left.y, pixel_size.y, height);
+                bool one_pixel = x0 == last_pixel(nodeMax.x, bottom_left.x, pixel_size.x, width) &&
+                                 y0 == last_pixel(nodeMax.y, bottom_left.y, pixel_size.y, height);
+                bool sub_pixel = 2 * top->m_range.x <= pixel_size.x && 2 * top->m_range.y <= pixel_size.y;
+
+                if (one_pixel || sub_pixel) {
+                    // Credit the whole subtree to one pixel.
+                    unsigned x = pixel(top->m_center.x, bottom_left.x, pixel_size.x, width);
+                    unsigned y = pixel(top->m_center.y, bottom_left.y, pixel_size.y, height);
+                    buffer[(size_t) y * width + x] += top->m_count;
+                    continue;
+                }
+            }
+
+            // Bin points of this node one by one, then go down to its children.
+            for (auto const &entry: top->m_bucket) {
+                if (!in_region(entry.first, bottom_left, top_right)) continue;
+                unsigned x = pixel(entry.first.x, bottom_left.x, pixel_size.x, width);
+                unsigned y = pixel(entry.first.y, bottom_left.y, pixel_size.y, height);
+                ++buffer[(size_t) y * width + x];
+            }
+            for (Node *child: top->m_children)
+                if (child != nullptr)
+                    nodes.push(child);
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<std::pair<Vertex, T>>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::segment_query(const Vertex &from, const Vertex &to,
+                                                              long double epsilon) {
+        Vertex delta = to - from;
+        std::vector<std::pair<long double, std::pair<Vertex, T>>> hits;
+
+        walk_segment(from, to, epsilon, [&](Node *node, long double) {
+            long double t;
+            for (auto const &entry: node->m_bucket)
+                if (near_segment(entry.first, from, delta, epsilon, t))
+                    hits.push_back({t, entry});
+            return true;
+        });
+
+        // Nodes come in order of entry, only points of overlapping nodes can still be out of order.
+        std::stable_sort(hits.begin(), hits.end(),
+                         [](const std::pair<long double, std::pair<Vertex, T>> &lhs,
+                            const std::pair<long double, std::pair<Vertex, T>> &rhs) {
+                             return lhs.first < rhs.first;
+                         });
+
+        std::vector<std::pair<Vertex, T>> results;
+        results.reserve(hits.size());
+        for (auto &hit: hits)
+            results.push_back(std::move(hit.second));
+        return results;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::pair<std::pair<Vertex, T>, bool>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::raycast(const Vertex &origin, const Vertex &direction,
+                                                        long double epsilon) {
+        // Cut the ray where it leaves the root, then walk it as a segment.
+        Vertex grow{epsilon, epsilon};
+        long double t_enter, t_exit;
+        if (!clip(origin, direction, m_root->bottom_left() - grow, m_root->top_right() + grow, t_enter, t_exit) ||
+            t_exit < 0)
+            return {};
+
+        // A zero direction leaves the line inside the box forever, it only tests the origin.
+        Vertex to = std::isinf(t_exit) ? origin : origin + direction * t_exit;
+        Vertex delta = to - origin;
+        std::pair<std::pair<Vertex, T>, bool> first{};
+        long double first_t = std::numeric_limits<long double>::infinity();
+
+        walk_segment(origin, to, epsilon, [&](Node *node, long double node_t) {
+            // Every point of this node and the ones after it lies further along the ray.
+            if (first.second && first_t <= node_t) return false;
+            long double t;
+            for (auto const &entry: node->m_bucket) {
+                if (near_segment(entry.first, origin, delta, epsilon, t) && t < first_t) {
+                    first_t = t;
+                    first = {entry, true};
+                }
+            }
+            return true;
+        });
+        return first;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    template<typename Visitor>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::walk_segment(const Vertex &from, const Vertex &to,
+                                                                  long double epsilon, Visitor visit) {
+        // Nodes crossed by the segment, popped by the position t in [0, 1] where the segment enters
+        // the node box grown by epsilon. A point within epsilon of the segment at t lies in a node entered
+        // at or before t, so nodes are handed to visit in order along the segment. visit returns false to stop.
+        typedef std::pair<long double, Node *> Crossing;
+        std::priority_queue<Crossing, std::vector<Crossing>, std::greater<Crossing>> crossings;
+        Vertex delta = to - from;
+        Vertex grow{epsilon, epsilon};
+
+        auto push = [&](Node *node) {
+            long double t_enter, t_exit;
+            if (clip(from, delta, node->bottom_left() - grow, node->top_right() + grow, t_enter, t_exit) &&
+                t_exit >= 0 && t_enter <= 1)
+                crossings.push({std::max(t_enter, 0.0L), node});
+        };
+
+        push(m_root);
+        while (!crossings.empty()) {
+            long double t = crossings.top().first;
+            Node *node = crossings.top().second;
+            crossings.pop();
+
+            if (!visit(node, t)) return;
+            for (Node *child: node->m_children)
+                if (child != nullptr)
+                    push(child);
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::clip(const Vertex &from, const Vertex &delta,
+                                                          const Vertex &box_min, const Vertex &box_max,
+                                                          long double &t_enter, long double &t_exit) {
+        // Slab test, [t_enter, t_exit] is where the line from + t * delta is inside the box.
+        t_enter = -std::numeric_limits<long double>::infinity();
+        t_exit = std::numeric_limits<long double>::infinity();
+        long double origins[2] = {from.x, from.y};
+        long double deltas[2] = {delta.x, delta.y};
+        long double mins[2] = {box_min.x, box_min.y};
+        long double maxs[2] = {box_max.x, box_max.y};
+
+        for (int axis = 0; axis < 2; ++axis) {
+            if (deltas[axis] == 0) {
+                if (origins[axis] < mins[axis] || origins[axis] > maxs[axis]) return false;
+                continue;
+            }
+            long double t0 = (mins[axis] - origins[axis]) / deltas[axis];
+            long double t1 = (maxs[axis] - origins[axis]) / deltas[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            t_enter = std::max(t_enter, t0);
+            t_exit = std::min(t_exit, t1);
+        }
+        return t_enter <= t_exit;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::near_segment(const Vertex &point, const Vertex &from,
+                                                                  const Vertex &delta, long double epsilon,
+                                                                  long double &t) {
+        // t is the position of the closest point of the segment.
+        long double length = delta.x * delta.x + delta.y * delta.y;
+        Vertex offset = point - from;
+        t = length > 0 ? std::max(0.0L, std::min(1.0L, (offset.x * delta.x + offset.y * delta.y) / length)) : 0;
+        Vertex gap = offset - delta * t;
+        return gap.x * gap.x + gap.y * gap.y <= epsilon * epsilon;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    Vertex QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::new_center(int direction, QuadTree::Node *node) {
         Vertex v(node->m_center.x, node->m_center.y);
         switch (direction) {
             case BOT_LEFT:
@@ -210,8 +1042,8 @@ namespace qt {
         return v;
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    int QuadTree<T, PairT, ContainerT>::direction(const Vertex &point, QuadTree::Node *node) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    int QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::direction(const Vertex &point, QuadTree::Node *node) {
         unsigned X = 0;
         unsigned Y = 0;
         X |= ((point.x >= node->m_center.x) << 1);
@@ -219,109 +1051,296 @@ namespace qt {
         return (int) (X | Y);
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    QuadTreeNode<T, PairT, ContainerT> *&QuadTree<T, PairT, ContainerT>::child_node(const Vertex &v,
-                                                                                    QuadTree::Node *&node) {
-        unsigned dir = direction(v, node);
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    int QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::direction(const Vertex &point, const Cell &key,
+                                                              QuadTree::Node *node, unsigned depth) const {
+        return direction(point, node->m_center, key, m_grid_bits, depth);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    int QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::direction(const Vertex &point, const Vertex &center,
+                                                              const Cell &key, unsigned grid_bits, unsigned depth) {
+        if (grid_bits == 0)
+            return (int) ((point.x >= center.x) << 1 | (point.y >= center.y));
+
+        // Grid mode, the child at depth d is given by bit (grid_bits - 1 - d) of each cell coordinate.
+        unsigned shift = grid_bits - 1 - depth;
+        return (int) (((key.first >> shift) & 1) << 1 | ((key.second >> shift) & 1));
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::Cell
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::cell(const Vertex &point) const {
+        return cell(point, m_root->bottom_left(), m_step, m_grid_bits);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::Cell
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::cell(const Vertex &point, const Vertex &origin,
+                                                     const Vertex &step, unsigned grid_bits) {
+        if (grid_bits == 0) return {0, 0};
+
+        // Clamped so that points outside of the root still map to a valid cell.
+        long double last = std::ldexp(1.0L, (int) grid_bits) - 1;
+        Vertex c = (point - origin) / step;
+        return {(uint64_t) std::max(0.0L, std::min(std::floor(c.x), last)),
+                (uint64_t) std::max(0.0L, std::min(std::floor(c.y), last))};
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTreeNode<T, PairT, ContainerT, AggregateT> *&QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::own(
+            QuadTree::Node *&node, QuadTree::Node *parent) {
+        if (node->is_shared()) {
+            // Node is still reachable from a snapshot, write to a private copy instead. Its children stay shared,
+            // their parent links are left to the snapshot and set when they are owned in turn.
+            Node *copy = Node::clone(*node);
+            Node::release(node);
+            node = copy;
+        }
+        node->m_parent = parent;
+        return node;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTreeNode<T, PairT, ContainerT, AggregateT> *&QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::child_node(
+            const Vertex &v, const Cell &key, QuadTree::Node *&node, unsigned depth) {
+        unsigned dir = direction(v, key, node, depth);
         if (node->m_children[dir] != nullptr) {
             // Child node already exists, return that child node.
-            return node->m_children[dir];
+            return own(node->m_children[dir], node);
         } else {
-            // Child node doesn't exist, create new one and return it.
-            node->m_children[dir] = new Node(new_center(dir, node), node->m_range / 2.0);
+            // Child node doesn't exist, create new one and return it. It is complete before readers can reach it.
+            Node *child = Node::create(new_center(dir, node), node->m_range / 2.0, node, node->m_depth + 1,
+                                       m_resource);
+            frame(child);
+            typename Node::WriteGuard guard(node);
+            node->m_children[dir] = child;
             return node->m_children[dir];
         }
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    std::pair<typename QuadTree<T, PairT, ContainerT>::viterator, bool> QuadTree<T, PairT, ContainerT>::insert(
-            const Vertex &v, const T &data,
-            QuadTree::Node *&node, QuadTree::Node *parent_node,
-            unsigned depth) {
-        std::pair<QuadTree<T, PairT, ContainerT>::viterator, bool> pit;
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTreeNode<T, PairT, ContainerT, AggregateT> *
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::descend(const Vertex &point, QuadTree::Node *node) {
+        // Deepest node on the way to point: its leaf, or the stem missing the child it would be in.
+        Cell key = cell(point);
+        while (!node->m_leaf) {
+            Node *child = node->m_children[direction(point, key, node, node->m_depth)];
+            if (child == nullptr) break;
+            node = child;
+        }
+        return node;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTreeNode<T, PairT, ContainerT, AggregateT> *
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::climb(const Vertex &point, QuadTree::Node *node) const {
+        // Smallest ancestor holding point, the root when no node does. The parent of a shared node may belong
+        // to a snapshot and be freed with it, links are only followed out of nodes this tree owns.
+        while (!node->is_shared() && node->m_parent != nullptr &&
+               !in_region(point, node->bottom_left(), node->top_right()))
+            node = node->m_parent;
+        return in_region(point, node->bottom_left(), node->top_right()) ? node : m_root;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTreeNode<T, PairT, ContainerT, AggregateT> *
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::seek(const Vertex &point, viterator &hint) {
+        Node *node = hint.node != nullptr ? climb(point, hint.node) : m_root;
+        bool owned = !node->is_shared();
+        Cell key = cell(point);
+
+        while (!node->m_leaf) {
+            Node *child = node->m_children[direction(point, key, node, node->m_depth)];
+            if (child == nullptr) break;
+            // A child of a copied node keeps the link to the snapshot's node, or none once that one is gone.
+            // Only this tree can reach a child it owns, so relinking it races with no reader.
+            if (owned && !child->is_shared())
+                child->m_parent = node;
+            else
+                owned = false;
+            node = child;
+        }
+
+        // A hint must never lead into nodes a snapshot can free.
+        hint = owned ? viterator(node) : viterator();
+        return node;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTreeNode<T, PairT, ContainerT, AggregateT> **
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::live_slot(QuadTree::Node *node) {
+        // A hinted write may only start from a node that is still in this tree and whose path from the root
+        // is not shared with a snapshot. Returns the pointer to node held by its parent, nullptr otherwise.
+        Node **slot = &m_root;
+        for (Node *n = node; n != nullptr; n = n->m_parent) {
+            if (n->is_shared()) return nullptr;
+            Node **link = &m_root;
+            if (n->m_parent != nullptr) {
+                Node **end = n->m_parent->m_children + 4;
+                link = std::find(n->m_parent->m_children, end, n);
+                if (link == end) return nullptr;
+            }
+            if (*link != n) return nullptr;
+            if (n == node) slot = link;
+        }
+        return slot;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::has_room(const ContainerT &bucket,
+                                                               const Vertex &point) const {
+        unsigned limit = bucket_limit();
+        if (!m_multimap || bucket.size() < limit) return bucket.size() < limit;
+
+        // Splitting can't separate copies of one point, so only distinct coordinates count against the bucket
+        // size. Copies past it stay in the leaf as the overflow list of their coordinate. At most limit + 1
+        // coordinates are tracked, the cost is linear in the bucket.
+        std::vector<Vertex> distinct{point};
+        for (auto const &entry: bucket) {
+            if (std::find(distinct.begin(), distinct.end(), entry.first) != distinct.end()) continue;
+            distinct.push_back(entry.first);
+            if (distinct.size() > limit) return false;
+        }
+        return true;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::frame(QuadTree::Node *node) const {
+        bucket_traits<ContainerT>::frame(node->m_bucket, node->bottom_left(), m_step, m_context);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::on_grid(const Vertex &point) const {
+        Vertex cell = (point - m_root->bottom_left()) / m_step;
+        return cell.x == std::floor(cell.x) && cell.y == std::floor(cell.y);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::pair<typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::viterator, bool> QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::insert(
+            const Vertex &v, const Cell &key, const T &data,
+            QuadTree::Node *&node, unsigned depth) {
+        std::pair<QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::viterator, bool> pit;
         // Insertion will not happen if insertion point's depth limit has been reached.
+        // node is owned by the caller, child_node() owns the children on the way down.
 
         // Insert only when the node is a leaf node
         if (node->m_leaf) {
-            if (node->m_bucket.size() < max_bucket_size) {
+            // Covers the split too, readers of this leaf retry and find it turned into a stem.
+            typename Node::WriteGuard guard(node);
+            if (has_room(node->m_bucket, v) && depth >= min_leaf_depth) {
                 // Bucket in that node is not full yet, add data to the m_bucket.
                 pit = {viterator(node), true};
-                typename std::vector<PairT>::iterator insert_it;
-                if (m_sort) {
-                    insert_it = std::lower_bound(node->m_bucket.begin(), node->m_bucket.end(),
-                                                 PairT{v, data}, m_pair_comp);
-                } else {
-                    insert_it = node->m_bucket.end();
-                }
-                node->set_parent(parent_node);
-                node->m_bucket.insert(insert_it, PairT{v, data});
+                PairT entry{v, data};
+                node->m_bucket.insert(insert_position(node->m_bucket, entry), entry);
+                ++node->m_count;
+                node->m_aggregate = AggregateT::combine(node->m_aggregate, AggregateT::lift(v, data));
                 return pit;
             } else if (depth < max_depth) {
                 // Change this m_leaf node to stem node first
                 node->m_leaf = false;
-                pit = insert(v, data, child_node(v, node), node, 1 + depth);
 
                 // Pull out data from this node and put it in corresponding child
                 for (int i = 0; i < node->m_bucket.size(); ++i) {
-                    pit = insert(node->m_bucket[i].first,
-                                 node->m_bucket[i].second,
-                                 child_node(node->m_bucket[i].first, node),
-                                 node,
-                                 1 + depth);
+                    Vertex point = node->m_bucket[i].first;
+                    Cell point_key = cell(point);
+                    insert(point,
+                           point_key,
+                           node->m_bucket[i].second,
+                           child_node(point, point_key, node, depth),
+                           1 + depth);
                 }
                 node->m_bucket.clear();
-                return pit;
+                pit = insert(v, key, data, child_node(v, key, node, depth), 1 + depth);
             }
         } else {
-            pit = insert(v, data, child_node(v, node), node, 1 + depth);
+            pit = insert(v, key, data, child_node(v, key, node, depth), 1 + depth);
+        }
+
+        // Points already in this subtree are accounted for, only the new one is added.
+        if (pit.second) {
+            ++node->m_count;
+            node->m_aggregate = AggregateT::combine(node->m_aggregate, AggregateT::lift(v, data));
             return pit;
         }
         return {};
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    void QuadTree<T, PairT, ContainerT>::reduce(std::stack<Node *> &nodes) {
-        bool canReduce = true;
-        typename std::vector<PairT>::iterator insert_it;
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename ContainerT::iterator
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::insert_position(ContainerT &bucket, const PairT &entry) const {
+        if constexpr (PolicyT::is_static) {
+            if constexpr (PolicyT::sort)
+                return std::lower_bound(bucket.begin(), bucket.end(), entry, m_pair_comp);
+            else
+                return bucket.end();
+        } else {
+            if (m_sort)
+                return std::lower_bound(bucket.begin(), bucket.end(), entry, m_pair_comp);
+            return bucket.end();
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::reduce(PathStack &nodes) {
         nodes.pop();
-        while (canReduce && !nodes.empty()) {
-            canReduce = true;
-            Node *top = nodes.top();
-            int numKeys = 0;
-            for (int i = 0; i < 4; ++i) {
-                if (top->m_children[i] && !top->m_children[i]->m_leaf) {
-                    return;
-                } else if (top->m_children[i] && top->m_children[i]->m_leaf) {
-                    numKeys += top->m_children[i]->m_bucket.size();
-                }
-            }
-            canReduce &= (numKeys <= max_bucket_size);
-            if (canReduce) {
-                for (int i = 0; i < 4; ++i) {
-                    if (top->m_children[i]) {
-                        top->m_children[i]->set_parent(top);
-                        for (int j = 0; j < top->m_children[i]->m_bucket.size(); ++j) {
-                            if (m_sort)
-                                insert_it = std::lower_bound(top->m_bucket.begin(),
-                                                             top->m_bucket.end(),
-                                                             top->m_children[i]->m_bucket[j],
-                                                             m_pair_comp);
-                            else
-                                insert_it = top->m_bucket.end();
-                            top->m_bucket.insert(insert_it, top->m_children[i]->m_bucket[j]);
-                        }
-                        delete top->m_children[i];
-                        top->m_children[i] = nullptr;
-                    }
-                }
-                top->m_leaf = true;
+        while (!nodes.empty() && collapse(nodes.top()))
+            nodes.pop();
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::collapse(QuadTree::Node *node) {
+        size_t numKeys = 0;
+        for (Node *child: node->m_children) {
+            if (child == nullptr) continue;
+            if (!child->m_leaf) return false;
+            numKeys += child->m_bucket.size();
+        }
+        if (numKeys > bucket_limit() || node->m_depth < min_leaf_depth) return false;
+
+        typename Node::WriteGuard guard(node);
+
+        for (Node *&child: node->m_children) {
+            if (child == nullptr) continue;
+            for (int j = 0; j < child->m_bucket.size(); ++j) {
+                PairT entry = child->m_bucket[j];
+                node->m_bucket.insert(insert_position(node->m_bucket, entry), entry);
             }
+            Node::release(child);
+            child = nullptr;
+        }
+        node->m_leaf = true;
+        return true;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::refresh_aggregate(QuadTree::Node *node) {
+        size_t count = 0;
+        aggregate_type aggregate = AggregateT::identity();
+        for (auto const &entry: node->m_bucket) {
+            aggregate = AggregateT::combine(aggregate, AggregateT::lift(entry.first, entry.second));
+            ++count;
+        }
+        for (Node *child: node->m_children) {
+            if (child == nullptr) continue;
+            aggregate = AggregateT::combine(aggregate, child->m_aggregate);
+            count += child->m_count;
+        }
+        node->m_count = count;
+        node->m_aggregate = aggregate;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::refresh_path(PathStack nodes) {
+        // Recompute from the bottom node of the path up to the root.
+        while (!nodes.empty()) {
+            refresh_aggregate(nodes.top());
             nodes.pop();
         }
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    void QuadTree<T, PairT, ContainerT>::add_points_to_result(QuadTree::Node *node,
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::add_points_to_result(QuadTree::Node *node,
                                                               std::vector<std::pair<Vertex, T>> &results) {
         if (node->m_leaf) {
             results.insert(results.end(), node->m_bucket.begin(), node->m_bucket.end());
@@ -334,8 +1353,61 @@ namespace qt {
         }
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    bool QuadTree<T, PairT, ContainerT>::in_region(const Vertex &point,
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::add_points_to_result(QuadTree::Node *node, int state,
+                                                                          traversal order,
+                                                                          std::vector<std::pair<Vertex, T>> &results) {
+        CurveStack nodes;
+        nodes.push({node, state});
+
+        while (!nodes.empty()) {
+            Node *top = nodes.top().first;
+            int top_state = nodes.top().second;
+            nodes.pop();
+
+            results.insert(results.end(), top->m_bucket.begin(), top->m_bucket.end());
+            push_children(nodes, top, top_state, order);
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::push_children(CurveStack &nodes,
+                                                                   QuadTree::Node *node, int state,
+                                                                   traversal order) {
+        // Child visiting order and the curve state of each visited child, for the four Hilbert curve orientations.
+        static const int hilbert_order[4][4] = {{0, 1, 3, 2}, {3, 1, 0, 2}, {3, 2, 0, 1}, {0, 2, 3, 1}};
+        static const int hilbert_state[4][4] = {{3, 0, 0, 1}, {2, 1, 1, 0}, {1, 2, 2, 3}, {0, 3, 3, 2}};
+
+        // Z order follows child indices, (x << 1 | y) is the Morton code of each child.
+        // Pushed in reverse so children are popped in visiting order.
+        for (int i = 3; i >= 0; --i) {
+            int dir = order == HILBERT_ORDER ? hilbert_order[state][i] : i;
+            int next = order == HILBERT_ORDER ? hilbert_state[state][i] : 0;
+            if (node->m_children[dir] != nullptr)
+                nodes.push({node->m_children[dir], next});
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    unsigned QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::last_pixel(long double end, long double origin,
+                                                                    long double pixel_size, unsigned pixels) {
+        long double index = std::ceil((end - origin) / pixel_size) - 1;
+        if (index < 0) return 0;
+        if (index >= pixels) return pixels - 1;
+        return (unsigned) index;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    unsigned QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::pixel(long double coordinate, long double origin,
+                                                               long double pixel_size, unsigned pixels) {
+        long double index = std::floor((coordinate - origin) / pixel_size);
+        if (index < 0) return 0;
+        if (index >= pixels) return pixels - 1;
+        return (unsigned) index;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::in_region(const Vertex &point,
                                                    const Vertex &bottom_left,
                                                    const Vertex &top_right) {
         return (point.x >= bottom_left.x) &&
@@ -344,42 +1416,558 @@ namespace qt {
                (point.y < top_right.y);
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    enclosure QuadTree<T, PairT, ContainerT>::status(const Vertex &center, const Vertex &range,
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    enclosure QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::status(const Vertex &center, const Vertex &range,
                                                      const Vertex &bottom_left, const Vertex &top_right) {
-        int enclosedPts = 0;
-        enclosedPts += in_region({center.x - range.x, center.y - range.y}, bottom_left, top_right);
-        enclosedPts += in_region({center.x - range.x, center.y + range.y}, bottom_left, top_right);
-        enclosedPts += in_region({center.x + range.x, center.y - range.y}, bottom_left, top_right);
-        enclosedPts += in_region({center.x + range.x, center.y + range.y}, bottom_left, top_right);
+        // Node box and region are both half-open, [min, max).
+        Vertex nodeMin{center - range};
+        Vertex nodeMax{center + range};
+
+        if (nodeMax.x <= bottom_left.x || nodeMin.x >= top_right.x ||
+            nodeMax.y <= bottom_left.y || nodeMin.y >= top_right.y)
+            return OUT_OF_BOUND;
 
-        if (enclosedPts == 4)
+        if (nodeMin.x >= bottom_left.x && nodeMax.x <= top_right.x &&
+            nodeMin.y >= bottom_left.y && nodeMax.y <= top_right.y)
             return IN_BOUND;
-        if (enclosedPts > 0)
-            return PARTIAL_BOUND;
 
-        Vertex nodeMin{center - range};
-        Vertex nodeMax(center + range);
-        enclosedPts += in_region(bottom_left, nodeMin, nodeMax);
-        enclosedPts += in_region({bottom_left.x, top_right.y}, nodeMin, nodeMax);
-        enclosedPts += in_region(bottom_left, nodeMin, nodeMax);
-        enclosedPts += in_region({bottom_left.x, top_right.y}, nodeMin, nodeMax);
+        return PARTIAL_BOUND;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<std::pair<Vertex, T>> QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::extract_all(traversal order) {
+        return data_in_region(m_root->m_center - m_root->m_range, m_root->m_center + m_root->m_range, order);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTreeNode<T, PairT, ContainerT, AggregateT> *QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::empty_root() const {
+        Node *root = Node::create(m_root->m_center, m_root->m_range, nullptr, 0, m_resource);
+        frame(root);
+        return root;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::subscribe(const Vertex &bottom_left,
+                                                                         const Vertex &top_right,
+                                                                         subscription_callback callback) {
+        return m_subscriptions.add(bottom_left, top_right, std::move(callback));
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::unsubscribe(size_t id) {
+        return m_subscriptions.remove(id);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    size_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::merge(QuadTree &&other) {
+        if (&other == this || other.m_size == 0) return 0;
+
+        // Other is left empty, which replays as splitting off its whole extent.
+        if (other.m_trace != nullptr) {
+            Vertex bottom_left = other.m_root->bottom_left(), top_right = other.m_root->top_right();
+            other.m_trace->record(TRACE_SPLIT_OFF, std::chrono::nanoseconds(0), bottom_left, &top_right);
+        }
+
+        // Grafted subtrees keep their shape, so they need the same node boxes, limits and bucket order.
+        bool same_layout = other.m_root->m_center == m_root->m_center && other.m_root->m_range == m_root->m_range &&
+                           other.m_grid_bits == m_grid_bits && other.max_depth == max_depth &&
+                           other.max_bucket_size == max_bucket_size && other.m_sort == m_sort &&
+                           other.m_multimap == m_multimap && other.m_context == m_context;
+
+        std::vector<std::pair<Vertex, T>> rejected;
+        if (!same_layout) {
+            // One by one, the inserts trace themselves. Points already here are dropped, those this tree can't
+            // hold go back to other.
+            std::vector<std::pair<Vertex, T>> entries;
+            entries.reserve(other.m_size);
+            // Straight from the buckets, a region query would be traced on other.
+            std::queue<Node *> nodes;
+            traverse(other.m_root, nodes);
+            for (; !nodes.empty(); nodes.pop())
+                for (auto const &entry: nodes.front()->m_bucket)
+                    entries.emplace_back(entry.first, entry.second);
+
+            for (auto const &entry: entries) {
+                if (!m_multimap && contains(entry.first)) continue;
+                if (!insert(entry.first, entry.second).second) rejected.push_back(entry);
+            }
+        } else {
+            // Grafted points replay like the points a trace starts with.
+            if (m_trace != nullptr)
+                for (auto it = other.begin(); it != other.end(); ++it)
+                    m_trace->record(TRACE_LOAD, std::chrono::nanoseconds(0), (*it).first);
+            own(m_root, nullptr);
+            merge(m_root, other.m_root, nullptr);
+            m_size = m_root->m_count;
+        }
+
+        Node *root = other.empty_root();
+        Node::release(other.m_root);
+        other.m_root = root;
+        other.m_size = 0;
+
+        // Rejected points came from other, they fit there again.
+        for (auto const &entry: rejected) {
+            other.m_size += other.insert(entry.first, other.cell(entry.first), entry.second,
+                                         own(other.m_root, nullptr), 0).second;
+            if (other.m_trace != nullptr)
+                other.m_trace->record(TRACE_LOAD, std::chrono::nanoseconds(0), entry.first);
+        }
+        return rejected.size();
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::merge(Node *&target, Node *&source, Node *parent) {
+        if (source == nullptr || source->m_count == 0) return;
+        // Source nodes may still be shared with snapshots of the other tree.
+        own(source, parent);
+
+        if (target == nullptr) {
+            // Only the other tree has points here, the subtree moves over untouched.
+            typename Node::WriteGuard guard(parent);
+            target = source;
+            source = nullptr;
+            return;
+        }
+
+        own(target, parent);
+        bool overwrite = false;
+        if (target->m_leaf && !source->m_leaf) {
+            // Keep the deeper subtree and put the leaf's points into it, they win over equal points there.
+            typename Node::WriteGuard guard(parent != nullptr ? parent : target);
+            std::swap(target, source);
+            target->m_parent = parent;
+            overwrite = true;
+        }
+
+        if (source->m_leaf) {
+            absorb(target, source->m_bucket, overwrite);
+        } else {
+            for (int dir = 0; dir < 4; ++dir)
+                merge(target->m_children[dir], source->m_children[dir], target);
+            typename Node::WriteGuard guard(target);
+            target->m_leaf = false;
+        }
+        refresh_aggregate(target);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::absorb(Node *&node, const ContainerT &bucket,
+                                                                 bool overwrite) {
+        for (auto const &entry: bucket) {
+            Vertex point = entry.first;
+            Cell key = cell(point);
+
+            if (!m_multimap) {
+                Node *leaf = descend(point, node);
+                auto it = std::find_if(leaf->m_bucket.begin(), leaf->m_bucket.end(),
+                                       [&](const PairT &other) { return other.first == point; });
+                if (it != leaf->m_bucket.end()) {
+                    if (!overwrite) continue;
+
+                    // Same walk as update(), from node down.
+                    PathStack nodes;
+                    nodes.push(own(node, node->m_parent));
+                    while (!nodes.top()->m_leaf) {
+                        Node *top = nodes.top();
+                        nodes.push(own(top->m_children[direction(point, key, top, top->m_depth)], top));
+                    }
+                    Node *top = nodes.top();
+                    for (size_t i = 0; i < top->m_bucket.size(); ++i) {
+                        if (top->m_bucket[i].first == point) {
+                            typename Node::WriteGuard guard(top);
+                            top->m_bucket[i].second = entry.second;
+                            break;
+                        }
+                    }
+                    refresh_path(nodes);
+                    continue;
+                }
+            }
+            insert(point, key, entry.second, node, node->m_depth);
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::split_off(const Vertex &bottom_left, const Vertex &top_right) {
+        TraceScope scope(m_trace, TRACE_SPLIT_OFF, bottom_left, &top_right);
+        QuadTree result{m_root->m_center, m_root->m_range, max_bucket_size, max_depth, m_sort, m_grid_bits,
+                        m_multimap, m_context, m_resource};
+
+        own(m_root, nullptr);
+        split_off(m_root, result.m_root, nullptr, nullptr, bottom_left, top_right);
+        // The whole tree was inside the region.
+        if (m_root == nullptr) m_root = result.empty_root();
+
+        m_size = m_root->m_count;
+        result.m_size = result.m_root->m_count;
+        return result;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::split_off(Node *&source, Node *&target,
+                                                                    Node *source_parent, Node *target_parent,
+                                                                    const Vertex &bottom_left,
+                                                                    const Vertex &top_right) {
+        if (source == nullptr || source->m_count == 0) return;
+
+        switch (status(source->m_center, source->m_range, bottom_left, top_right)) {
+            case IN_BOUND: {
+                // Detach the whole subtree, only the root of the new tree can be there already, and empty.
+                own(source, source_parent);
+                Node::release(target);
+                target = source;
+                target->m_parent = target_parent;
+                source = nullptr;
+                return;
+            }
+
+            case PARTIAL_BOUND: {
+                Node *from = own(source, source_parent);
+                if (target == nullptr) {
+                    target = Node::create(from->m_center, from->m_range, target_parent, from->m_depth, m_resource);
+                    frame(target);
+                }
+                Node *to = target;
+
+                if (from->m_leaf) {
+                    typename Node::WriteGuard guard(from);
+                    for (size_t i = 0; i < from->m_bucket.size();) {
+                        if (in_region(from->m_bucket[i].first, bottom_left, top_right)) {
+                            PairT entry = from->m_bucket[i];
+                            to->m_bucket.insert(insert_position(to->m_bucket, entry), entry);
+                            from->m_bucket.erase(from->m_bucket.begin() + i);
+                        } else {
+                            ++i;
+                        }
+                    }
+                } else {
+                    to->m_leaf = false;
+                    for (int dir = 0; dir < 4; ++dir)
+                        split_off(from->m_children[dir], to->m_children[dir], from, to, bottom_left, top_right);
+                }
 
-        if (enclosedPts > 0)
-            return PARTIAL_BOUND;
+                // Both sides lost or gained points only near the boundary, merge what became small.
+                refresh_aggregate(from);
+                refresh_aggregate(to);
+                if (!from->m_leaf) collapse(from);
+                if (!to->m_leaf) collapse(to);
+                return;
+            }
 
-        return OUT_OF_BOUND;
+            default:
+                return;
+        }
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    std::vector<std::pair<Vertex, T>> QuadTree<T, PairT, ContainerT>::extract_all() {
-        return data_in_region(m_root->m_center - m_root->m_range, m_root->m_center + m_root->m_range);
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::snapshot_type
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::snapshot() const {
+        return snapshot_type(*this);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::cursor_type
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::nearest_cursor(const Vertex &point) const {
+        return cursor_type(*this, point);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::trace(TraceWriter *writer) {
+        m_trace = nullptr;
+        if (writer == nullptr) return true;
+        // A replay has no expiry times to run expire() with.
+        if (is_expiry_aggregate<AggregateT>::value) return false;
+
+        // Configuration and current points first, a replay starts from the same tree.
+        if (!writer->header(m_root->m_center, m_root->m_range, max_bucket_size, max_depth, m_sort, m_grid_bits,
+                            m_multimap))
+            return false;
+        for (auto it = begin(); it != end(); ++it)
+            writer->record(TRACE_LOAD, std::chrono::nanoseconds(0), (*it).first);
+        if (!writer->good()) return false;
+        m_trace = writer;
+        return true;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::frozen_type
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::freeze(layout order) const {
+        return frozen_type(*this, order);
+    }
+
+    // Frozen tree
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::FrozenQuadTree(const QuadTree &tree,
+                                                                                      layout order) {
+        m_center = tree.m_root->m_center;
+        m_range = tree.m_root->m_range;
+        m_grid_bits = tree.m_grid_bits;
+        m_step = tree.m_step;
+
+        // Pack in preorder first, which puts the points in Z order.
+        std::vector<PackedNode> preorder;
+        unsigned height = 0;
+        m_points.reserve(tree.m_size);
+        pack(tree.m_root, 0, height, preorder, m_points);
+
+        std::vector<uint32_t> sequence;
+        sequence.reserve(preorder.size());
+        if (order == VEB_LAYOUT) {
+            veb_order(preorder, 0, height + 1, sequence);
+        } else {
+            sequence.push_back(0);
+            for (size_t i = 0; i < sequence.size(); ++i)
+                for (uint32_t child: preorder[sequence[i]].children)
+                    if (child != no_child)
+                        sequence.push_back(child);
+        }
+
+        // Move nodes to their place in the layout and renumber the children.
+        std::vector<uint32_t> position(preorder.size());
+        for (uint32_t i = 0; i < sequence.size(); ++i)
+            position[sequence[i]] = i;
+        m_nodes.resize(preorder.size());
+        for (uint32_t i = 0; i < sequence.size(); ++i) {
+            PackedNode node = preorder[sequence[i]];
+            for (uint32_t &child: node.children)
+                if (child != no_child)
+                    child = position[child];
+            m_nodes[i] = node;
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    uint32_t QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::pack(
+            const Node *node, unsigned depth, unsigned &height,
+            std::vector<PackedNode> &nodes, std::vector<std::pair<Vertex, T>> &points) {
+        uint32_t index = nodes.size();
+        nodes.push_back({{no_child, no_child, no_child, no_child}, (uint32_t) points.size(), 0});
+        height = std::max(height, depth);
+
+        if (node->m_leaf) {
+            for (auto const &entry: node->m_bucket)
+                points.emplace_back(entry.first, entry.second);
+        } else {
+            for (int i = 0; i < 4; ++i) {
+                if (node->m_children[i] != nullptr) {
+                    uint32_t child = pack(node->m_children[i], depth + 1, height, nodes, points);
+                    nodes[index].children[i] = child;
+                }
+            }
+        }
+        nodes[index].end = points.size();
+        return index;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::veb_order(
+            const std::vector<PackedNode> &nodes, uint32_t root, unsigned height, std::vector<uint32_t> &order) {
+        if (height == 1) {
+            order.push_back(root);
+            return;
+        }
+
+        // Top half of the levels first, then every subtree hanging below it, each laid out the same way.
+        unsigned top = height / 2;
+        veb_order(nodes, root, top, order);
+
+        std::vector<uint32_t> bottom;
+        nodes_at_depth(nodes, root, top, bottom);
+        for (uint32_t subtree: bottom)
+            veb_order(nodes, subtree, height - top, order);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::nodes_at_depth(
+            const std::vector<PackedNode> &nodes, uint32_t root, unsigned depth, std::vector<uint32_t> &result) {
+        if (depth == 0) {
+            result.push_back(root);
+            return;
+        }
+        for (uint32_t child: nodes[root].children)
+            if (child != no_child)
+                nodes_at_depth(nodes, child, depth - 1, result);
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    const T *QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::at(const Vertex &point) const {
+        const std::pair<Vertex, T> *found = find(point);
+        return found != nullptr ? &found->second : nullptr;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    const std::pair<Vertex, T> *
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::find(const Vertex &point) const {
+        Cell key = cell(point, m_center - m_range, m_step, m_grid_bits);
+        Visit visit = root();
+
+        while (!is_leaf(m_nodes[visit.index])) {
+            int dir = direction(point, visit.center, key, m_grid_bits, visit.depth);
+            if (m_nodes[visit.index].children[dir] == no_child)
+                return nullptr;
+            visit = child(visit, dir);
+        }
+
+        const PackedNode &leaf = m_nodes[visit.index];
+        for (uint32_t i = leaf.begin; i < leaf.end; ++i)
+            if (m_points[i].first == point)
+                return &m_points[i];
+        return nullptr;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    bool QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::contains(const Vertex &point) const {
+        return at(point) != nullptr;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::vector<std::pair<Vertex, T>>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::data_in_region(
+            const Vertex &bottom_left, const Vertex &top_right) const {
+        std::vector<std::pair<Vertex, T>> results{};
+        ranges_in_region(bottom_left, top_right, [&](uint32_t begin, uint32_t end) {
+            results.insert(results.end(), m_points.begin() + begin, m_points.begin() + end);
+        });
+        return results;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    template<typename Visitor>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::ranges_in_region(
+            const Vertex &bottom_left, const Vertex &top_right, Visitor visit) const {
+        std::vector<Visit> visits{root()};
+
+        while (!visits.empty()) {
+            Visit visit_node = visits.back();
+            visits.pop_back();
+            const PackedNode &node = m_nodes[visit_node.index];
+
+            switch (status(visit_node.center, visit_node.range, bottom_left, top_right)) {
+                case IN_BOUND:
+                    if (node.begin < node.end) visit(node.begin, node.end);
+                    break;
+
+                case PARTIAL_BOUND:
+                    if (is_leaf(node)) {
+                        uint32_t begin = node.begin;
+                        for (uint32_t i = node.begin; i < node.end; ++i) {
+                            if (in_region(m_points[i].first, bottom_left, top_right)) continue;
+                            if (begin < i) visit(begin, i);
+                            begin = i + 1;
+                        }
+                        if (begin < node.end) visit(begin, node.end);
+                    } else {
+                        for (int i = 3; i >= 0; --i)
+                            if (node.children[i] != no_child)
+                                visits.push_back(child(visit_node, i));
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    const std::pair<Vertex, T> *
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree::nearest(const Vertex &point) const {
+        const std::pair<Vertex, T> *best = nullptr;
+        long double best_distance = std::numeric_limits<long double>::infinity();
+
+        // Squared distance from the point to a node box, 0 inside of it.
+        auto box_distance = [&point](const Visit &visit) {
+            long double dx = std::max(std::abs(point.x - visit.center.x) - visit.range.x, 0.0L);
+            long double dy = std::max(std::abs(point.y - visit.center.y) - visit.range.y, 0.0L);
+            return dx * dx + dy * dy;
+        };
+
+        // Depth-first, nearer children are visited first and boxes farther than the best point are skipped.
+        std::vector<std::pair<long double, Visit>> visits{{0.0L, root()}};
+        while (!visits.empty()) {
+            long double distance = visits.back().first;
+            Visit visit = visits.back().second;
+            visits.pop_back();
+            if (distance >= best_distance) continue;
+
+            const PackedNode &node = m_nodes[visit.index];
+            if (is_leaf(node)) {
+                for (uint32_t i = node.begin; i < node.end; ++i) {
+                    Vertex d = m_points[i].first - point;
+                    long double squared = d.x * d.x + d.y * d.y;
+                    if (squared < best_distance) {
+                        best_distance = squared;
+                        best = &m_points[i];
+                    }
+                }
+                continue;
+            }
+
+            size_t first = visits.size();
+            for (int i = 0; i < 4; ++i) {
+                if (node.children[i] == no_child) continue;
+                Visit next = child(visit, i);
+                long double next_distance = box_distance(next);
+                if (next_distance < best_distance)
+                    visits.push_back({next_distance, next});
+            }
+            std::sort(visits.begin() + first, visits.end(),
+                      [](const std::pair<long double, Visit> &lhs, const std::pair<long double, Visit> &rhs) {
+                          return lhs.first > rhs.first;
+                      });
+        }
+        return best;
+    }
+
+    // Nearest cursor
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::NearestCursor::NearestCursor(const QuadTree &tree,
+                                                                                      const Vertex &point) :
+            m_tree(tree), m_point(point), m_distance(0) {
+        m_queue.push({box_distance(m_tree.m_root), m_tree.m_root, no_point});
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    long double QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::NearestCursor::box_distance(const Node *node) const {
+        // Squared distance from the point to the node box, 0 inside of it.
+        long double dx = std::max(std::abs(m_point.x - node->m_center.x) - node->m_range.x, 0.0L);
+        long double dy = std::max(std::abs(m_point.y - node->m_center.y) - node->m_range.y, 0.0L);
+        return dx * dx + dy * dy;
+    }
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    std::optional<std::pair<Vertex, T>> QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::NearestCursor::next() {
+        while (!m_queue.empty()) {
+            Entry entry = m_queue.top();
+            m_queue.pop();
+
+            // The snapshot keeps every node alive and unchanged, so bucket indices stay valid between calls.
+            if (entry.index != no_point) {
+                m_distance = std::sqrt(entry.distance);
+                return std::pair<Vertex, T>(entry.node->m_bucket[entry.index].first,
+                                            entry.node->m_bucket[entry.index].second);
+            }
+
+            Node *node = entry.node;
+            for (size_t i = 0; i < node->m_bucket.size(); ++i) {
+                Vertex d = node->m_bucket[i].first - m_point;
+                m_queue.push({d.x * d.x + d.y * d.y, node, i});
+            }
+            for (Node *child: node->m_children)
+                if (child != nullptr)
+                    m_queue.push({box_distance(child), child, no_point});
+        }
+        return std::nullopt;
     }
 
     // Printing data
 
-    template<typename T, typename PairT, typename ContainerT>
-    void QuadTree<T, PairT, ContainerT>::print_nodes(Node *&node, unsigned int depth) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::print_nodes(Node *&node, unsigned int depth) {
         // Print this node's address
         for (unsigned int i = 0; i < depth; ++i) std::cout << "|   ";
         printf("|  At depth = %d, Node at address %p has m_parent %p", depth, node, node->m_parent);
@@ -411,8 +1999,8 @@ namespace qt {
     }
 
 
-    template<typename T, typename PairT, typename ContainerT>
-    void QuadTree<T, PairT, ContainerT>::print_data(Node *&node) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::print_data(Node *&node) {
         if (node == nullptr) return;
 
         for (auto const &data: node->m_bucket)
@@ -423,8 +2011,8 @@ namespace qt {
                 print_data(child);
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    void QuadTree<T, PairT, ContainerT>::traverse(QuadTree::Node *node, std::queue<Node *> &nodes) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::traverse(QuadTree::Node *node, std::queue<Node *> &nodes) {
         if (node == nullptr) return;
         nodes.push(node);
         for (Node *&child: node->m_children)
@@ -432,8 +2020,8 @@ namespace qt {
                 traverse(child, nodes);
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    void QuadTree<T, PairT, ContainerT>::data_in_subtrees(QuadTree::Node *node) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    void QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::data_in_subtrees(QuadTree::Node *node) {
         std::queue<Node *> nodes;
         Node *top;
 
@@ -449,20 +2037,22 @@ namespace qt {
 
     // Element access
 
-    template<typename T, typename PairT, typename ContainerT>
-    T *QuadTree<T, PairT, ContainerT>::at(long double x, long double y) {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    T *QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::at(long double x, long double y) {
         return at(Vertex(x, y));
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    T *QuadTree<T, PairT, ContainerT>::at(const Vertex &point) {
-        std::stack<Node *> nodes;
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    T *QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::at(const Vertex &point) {
+        TraceScope scope(m_trace, TRACE_AT, point);
+        PathStack nodes;
         nodes.push(m_root);
         Node *top = nodes.top();
+        Cell key = cell(point);
         unsigned dir;
 
         while (!top->m_leaf) {
-            dir = direction(point, top);
+            dir = direction(point, key, top, nodes.size() - 1);
             if (top->m_children[dir] != nullptr) {
                 nodes.push(top->m_children[dir]);
                 top = nodes.top();
@@ -477,25 +2067,75 @@ namespace qt {
         return nullptr;
     }
 
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    T *QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::at(const Vertex &point, viterator &hint) {
+        TraceScope scope(m_trace, TRACE_AT, point);
+        Node *node = seek(point, hint);
+
+        for (size_t i = 0; i < node->m_bucket.size(); ++i)
+            if (node->m_bucket[i].first == point)
+                return &node->m_bucket[i].second;
+        return nullptr;
+    }
+
     // Iterator
 
-    template<typename T, typename PairT, typename ContainerT>
-    typename QuadTree<T, PairT, ContainerT>::viterator QuadTree<T, PairT, ContainerT>::vbegin() {
-        return viterator(m_root);
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::viterator QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::vbegin(traversal order) {
+        return viterator(m_root, order);
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    typename QuadTree<T, PairT, ContainerT>::viterator QuadTree<T, PairT, ContainerT>::vend() {
-        return viterator(m_root);
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::viterator QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::vend() {
+        return viterator();
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    typename QuadTree<T, PairT, ContainerT>::iterator QuadTree<T, PairT, ContainerT>::begin() {
-        return iterator(m_root);
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::iterator QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::begin(traversal order) {
+        return iterator(m_root, order);
     }
 
-    template<typename T, typename PairT, typename ContainerT>
-    typename QuadTree<T, PairT, ContainerT>::iterator QuadTree<T, PairT, ContainerT>::end() {
-        return iterator(m_root);
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    typename QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::iterator QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::end() {
+        return iterator();
+    }
+
+    // Spatial join
+
+    template<typename TreeA, typename TreeB, typename Predicate, typename Callback>
+    void spatial_join(TreeA &tree_a, TreeB &tree_b, const Predicate &predicate, Callback callback) {
+        typedef typename TreeA::node_type NodeA;
+        typedef typename TreeB::node_type NodeB;
+
+        std::stack<std::pair<NodeA *, NodeB *>> pairs;
+        pairs.push({tree_a.root(), tree_b.root()});
+
+        while (!pairs.empty()) {
+            NodeA *a = pairs.top().first;
+            NodeB *b = pairs.top().second;
+            pairs.pop();
+
+            if (!predicate.overlaps(a->bottom_left(), a->top_right(), b->bottom_left(), b->top_right()))
+                continue;
+
+            // Both leaves, test every pair of points.
+            if (a->is_leaf() && b->is_leaf()) {
+                for (auto const &pa: a->bucket())
+                    for (auto const &pb: b->bucket())
+                        if (predicate(pa.first, pb.first))
+                            callback(pa, pb);
+                continue;
+            }
+
+            // Descend into the larger stem node (or the only stem node) of the pair.
+            bool split_a = b->is_leaf() ||
+                           (!a->is_leaf() && a->range().x + a->range().y >= b->range().x + b->range().y);
+            for (int i = 0; i < 4; ++i) {
+                if (split_a && a->child(i) != nullptr)
+                    pairs.push({a->child(i), b});
+                else if (!split_a && b->child(i) != nullptr)
+                    pairs.push({a, b->child(i)});
+            }
+        }
     }
 }
@@ -5,14 +5,24 @@
 #include <cstddef>
 #include <vector>
 #include <stack>
+#include <deque>
+#include <type_traits>
 #include <queue>
 #include <string>
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <cstdio>
+#include <cmath>
+#include <limits>
+#include <memory_resource>
+#include <optional>
 
 #include "vec2.h"
 #include "qtnode.h"
+#include "qtbucket.h"
+#include "qttrace.h"
+#include "qtsubscription.h"
 
 #define BOT_LEFT 0
 #define TOP_LEFT 1
@@ -28,10 +38,215 @@ namespace qt {
     using enclosure::PARTIAL_BOUND;
     using enclosure::IN_BOUND;
 
-    template<typename T, typename PairT = std::pair<Vertex, T>, typename ContainerT = std::vector<PairT>>
+    // Order of points in extraction and iteration. ANY_ORDER is the cheapest order of each operation,
+    // Z_ORDER visits children by Morton code, HILBERT_ORDER along a Hilbert curve.
+    enum traversal {
+        ANY_ORDER, Z_ORDER, HILBERT_ORDER
+    };
+
+    using traversal::ANY_ORDER;
+    using traversal::Z_ORDER;
+    using traversal::HILBERT_ORDER;
+
+    // Node order of a frozen tree. VEB_LAYOUT is the cache-oblivious van Emde Boas order,
+    // BFS_LAYOUT stores nodes level by level.
+    enum layout {
+        VEB_LAYOUT, BFS_LAYOUT
+    };
+
+    using layout::VEB_LAYOUT;
+    using layout::BFS_LAYOUT;
+
+    // Result of QuadTree::estimate_count(). The true count lies in [low, high], count is the estimate in between.
+    struct CountEstimate {
+        double count;
+        size_t low;
+        size_t high;
+    };
+
+    // Spatial join predicates.
+    // operator() tests a pair of points, overlaps() tells whether any pair of points
+    // taken from two boxes can possibly satisfy the predicate (used for pruning).
+
+    class WithinDistance {
+    private:
+        long double m_radius;
+
+    public:
+        explicit WithinDistance(long double radius) : m_radius{radius} {}
+
+        bool operator()(const Vertex &a, const Vertex &b) const {
+            Vertex d = a - b;
+            return d.x * d.x + d.y * d.y <= m_radius * m_radius;
+        }
+
+        bool overlaps(const Vertex &bl_a, const Vertex &tr_a, const Vertex &bl_b, const Vertex &tr_b) const {
+            long double dx = std::max({bl_a.x - tr_b.x, bl_b.x - tr_a.x, 0.0L});
+            long double dy = std::max({bl_a.y - tr_b.y, bl_b.y - tr_a.y, 0.0L});
+            return dx * dx + dy * dy <= m_radius * m_radius;
+        }
+    };
+
+    class WithinBox {
+    private:
+        Vertex m_half;
+
+    public:
+        explicit WithinBox(const Vertex &half_extent) : m_half{half_extent} {}
+
+        bool operator()(const Vertex &a, const Vertex &b) const {
+            return std::abs(a.x - b.x) <= m_half.x && std::abs(a.y - b.y) <= m_half.y;
+        }
+
+        bool overlaps(const Vertex &bl_a, const Vertex &tr_a, const Vertex &bl_b, const Vertex &tr_b) const {
+            return bl_a.x - tr_b.x <= m_half.x && bl_b.x - tr_a.x <= m_half.x &&
+                   bl_a.y - tr_b.y <= m_half.y && bl_b.y - tr_a.y <= m_half.y;
+        }
+    };
+
+    // Simple or self-intersecting polygon under the even-odd rule, vertices in either winding order.
+    // Edges are indexed by horizontal bands so that point and box tests only look at edges near them.
+    class Polygon {
+    private:
+        std::vector<Vertex> m_vertices;
+        std::vector<std::vector<unsigned>> m_bands;
+        Vertex m_min;
+        Vertex m_max;
+        long double m_band_height;
+
+        unsigned band(long double y) const {
+            long double index = std::floor((y - m_min.y) / m_band_height);
+            if (index < 0) return 0;
+            if (index >= m_bands.size()) return m_bands.size() - 1;
+            return (unsigned) index;
+        }
+
+        // Whether edge i touches the closed box.
+        bool edge_crosses(unsigned i, const Vertex &bottom_left, const Vertex &top_right) const {
+            const Vertex &a = m_vertices[i];
+            const Vertex &b = m_vertices[(i + 1) % m_vertices.size()];
+            if (std::max(a.x, b.x) < bottom_left.x || std::min(a.x, b.x) > top_right.x ||
+                std::max(a.y, b.y) < bottom_left.y || std::min(a.y, b.y) > top_right.y)
+                return false;
+
+            // Bounding boxes overlap, the edge misses the box only if all corners are on one side of its line.
+            Vertex corners[4] = {bottom_left, {bottom_left.x, top_right.y}, {top_right.x, bottom_left.y}, top_right};
+            int below = 0, above = 0;
+            for (auto const &c: corners) {
+                long double side = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+                below += side < 0;
+                above += side > 0;
+            }
+            return below < 4 && above < 4;
+        }
+
+    public:
+        explicit Polygon(std::vector<Vertex> vertices) : m_vertices(std::move(vertices)), m_band_height(1) {
+            if (m_vertices.empty()) return;
+
+            m_min = m_max = m_vertices[0];
+            for (auto const &v: m_vertices) {
+                m_min = Vertex{std::min(m_min.x, v.x), std::min(m_min.y, v.y)};
+                m_max = Vertex{std::max(m_max.x, v.x), std::max(m_max.y, v.y)};
+            }
+
+            // About four edges per band, every edge is listed in each band its y extent overlaps.
+            unsigned bands = std::max<size_t>(1, m_vertices.size() / 4);
+            if (m_max.y > m_min.y) m_band_height = (m_max.y - m_min.y) / bands;
+            m_bands.resize(bands);
+            for (unsigned i = 0; i < m_vertices.size(); ++i) {
+                const Vertex &a = m_vertices[i];
+                const Vertex &b = m_vertices[(i + 1) % m_vertices.size()];
+                for (unsigned j = band(std::min(a.y, b.y)); j <= band(std::max(a.y, b.y)); ++j)
+                    m_bands[j].push_back(i);
+            }
+        }
+
+        const std::vector<Vertex> &vertices() const {
+            return m_vertices;
+        }
+
+        Vertex bottom_left() const {
+            return m_min;
+        }
+
+        Vertex top_right() const {
+            return m_max;
+        }
+
+        bool contains(const Vertex &point) const {
+            if (m_vertices.size() < 3 || point.y < m_min.y || point.y > m_max.y) return false;
+
+            // Crossings of a ray going right from the point, only edges of its band can cross it.
+            bool inside = false;
+            for (unsigned i: m_bands[band(point.y)]) {
+                const Vertex &a = m_vertices[i];
+                const Vertex &b = m_vertices[(i + 1) % m_vertices.size()];
+                if ((a.y > point.y) != (b.y > point.y) &&
+                    point.x < a.x + (point.y - a.y) * (b.x - a.x) / (b.y - a.y))
+                    inside = !inside;
+            }
+            return inside;
+        }
+
+        // Same classification as QuadTree::status() for rectangles. A box crossed by no edge is either
+        // wholly inside or wholly outside, its center tells which.
+        enclosure status(const Vertex &bottom_left, const Vertex &top_right) const {
+            if (m_vertices.size() < 3 ||
+                top_right.x < m_min.x || bottom_left.x > m_max.x ||
+                top_right.y < m_min.y || bottom_left.y > m_max.y)
+                return OUT_OF_BOUND;
+
+            for (unsigned j = band(bottom_left.y); j <= band(top_right.y); ++j)
+                for (unsigned i: m_bands[j])
+                    if (edge_crosses(i, bottom_left, top_right))
+                        return PARTIAL_BOUND;
+
+            return contains((bottom_left + top_right) / 2.0) ? IN_BOUND : OUT_OF_BOUND;
+        }
+    };
+
+    // Bucket size, depth limit and bucket sorting given to the constructor.
+    struct RuntimePolicy {
+        static constexpr bool is_static = false;
+    };
+
+    // Bucket size, depth limit and bucket sorting fixed at compile time, constructor arguments for them are ignored.
+    template<unsigned BucketSize, unsigned MaxDepth, bool Sort = false>
+    struct Policy {
+        static_assert(BucketSize > 0 && MaxDepth > 0, "Policy needs a non-zero bucket size and depth");
+
+        static constexpr bool is_static = true;
+        static constexpr unsigned bucket_size = BucketSize;
+        static constexpr unsigned max_depth = MaxDepth;
+        static constexpr bool sort = Sort;
+    };
+
+    // Storage of the root-to-leaf path of a descent, held inline when the policy bounds the depth.
+    template<typename PolicyT, typename NodeT>
+    struct path_container {
+        typedef std::deque<NodeT *> type;
+    };
+
+    template<unsigned BucketSize, unsigned MaxDepth, bool Sort, typename NodeT>
+    struct path_container<Policy<BucketSize, MaxDepth, Sort>, NodeT> {
+        typedef small_vector<NodeT *, 1 + MaxDepth> type;
+    };
+
+    template<typename T, typename PairT = std::pair<Vertex, T>, typename ContainerT = std::vector<PairT>,
+            typename AggregateT = NoAggregate<T>, typename PolicyT = RuntimePolicy>
     class QuadTree {
     private:
-        typedef QuadTreeNode<T, PairT, ContainerT> Node;
+        typedef QuadTreeNode<T, PairT, ContainerT, AggregateT> Node;
+
+        // Pending nodes of a depth-first walk with their curve state, vector backed so that an empty one is free.
+        typedef std::stack<std::pair<Node *, int>, std::vector<std::pair<Node *, int>>> CurveStack;
+
+        // Root-to-leaf path of a descent, stored inline when the policy fixes the depth.
+        typedef std::stack<Node *, typename path_container<PolicyT, Node>::type> PathStack;
+
+        // Integer grid cell of a point, computed once per operation in grid mode.
+        typedef std::pair<uint64_t, uint64_t> Cell;
 
         class PairComp;
 
@@ -39,25 +254,91 @@ namespace qt {
 
         class TreeIterator;
 
-        QuadTreeNode<T> *m_root;
+        class TreeSnapshot;
+
+        class FrozenQuadTree;
+
+        class NearestCursor;
+
+        Node *m_root;
         PairComp m_pair_comp;
         unsigned max_depth;
         unsigned max_bucket_size;
         bool m_sort;
         size_t m_size;
+        unsigned m_grid_bits;
+        unsigned min_leaf_depth;
+        Vertex m_step;
+        TraceWriter *m_trace;
+        bool m_multimap;
+        typename bucket_traits<ContainerT>::context_type m_context;
+        std::pmr::memory_resource *m_resource;
+        SubscriptionIndex<T> m_subscriptions;
 
     public:
+        typedef Node node_type;
+        typedef typename AggregateT::value_type aggregate_type;
         typedef TreeNodeIterator viterator;
         typedef TreeIterator iterator;
-
-        explicit QuadTree<T, PairT, ContainerT>(Vertex center = Vertex{0, 0},
-                                                Vertex range = Vertex{1, 1},
-                                                unsigned bucket_size = 1,
-                                                unsigned depth = 16,
-                                                bool sort = false);
+        typedef TreeSnapshot snapshot_type;
+        typedef FrozenQuadTree frozen_type;
+        typedef NearestCursor cursor_type;
+        typedef typename SubscriptionIndex<T>::callback_type subscription_callback;
+
+        explicit QuadTree(Vertex center = Vertex{0, 0},
+                          Vertex range = Vertex{1, 1},
+                          unsigned bucket_size = 1,
+                          unsigned depth = 16,
+                          bool sort = false,
+                          unsigned grid_bits = 0,
+                          bool multimap = false,
+                          typename bucket_traits<ContainerT>::context_type context = {},
+                          std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+        // Takes the nodes of other, which is left empty. Other gets a fresh root, if that allocation fails the
+        // program terminates.
+        QuadTree(QuadTree &&other) noexcept;
 
         ~QuadTree();
 
+        QuadTree &operator=(const QuadTree &) = delete;
+
+        // Releases the nodes of this tree and takes those of other, which is left empty.
+        QuadTree &operator=(QuadTree &&other) noexcept;
+
+        // Immutable version of the tree in O(1), later writes copy only the nodes they touch.
+        snapshot_type snapshot() const;
+
+        // Appends every insert, update, remove, at, data_in_region and split_off with its duration to writer,
+        // nullptr stops tracing. The tree configuration and its current points are written first. The writer must
+        // outlive tracing. False, and tracing stays off, when writer isn't open, the first records can't be
+        // written or the tree has an ExpiryAggregate, whose expire() a replay can't repeat.
+        bool trace(TraceWriter *writer);
+
+        // Calls callback(event, point, data) after every insert, remove and update of a point in
+        // [bottom_left, top_right), returns the id to unsubscribe with. Bulk merge, split_off and expire don't
+        // notify. Snapshots have no subscriptions, a moved tree takes its source's.
+        size_t subscribe(const Vertex &bottom_left, const Vertex &top_right, subscription_callback callback);
+
+        bool unsubscribe(size_t id);
+
+        // Moves every point of other into this tree. When both trees have the same root extent, grid, depth,
+        // bucket size, sort, multimap mode and bucket context, subtrees only other has points in are grafted
+        // whole, and buckets are merged only where both trees have points. Otherwise the points of other are
+        // inserted one by one. Points already here keep their data. Returns how many points this tree couldn't
+        // hold, outside its extent, off its grid or past a full leaf at its depth limit, they are left in other.
+        // A trace records the grafted points as loaded and other's trace records it split off whole, then the
+        // rejected points loaded again.
+        size_t merge(QuadTree &&other);
+
+        // Moves the points in [bottom_left, top_right) into a new tree with the same configuration.
+        // Enclosed subtrees are detached whole, only nodes crossing the boundary are visited.
+        // The new tree isn't traced.
+        QuadTree split_off(const Vertex &bottom_left, const Vertex &top_right);
+
+        // Read-only copy of the tree packed into contiguous arrays for fast queries.
+        frozen_type freeze(layout order = VEB_LAYOUT) const;
+
         Node *&root() {
             return m_root;
         }
@@ -76,36 +357,207 @@ namespace qt {
 
         bool contains(const Vertex &point);
 
+        // Hinted operations start from a leaf handle (as returned by insert or left in hint by at and contains),
+        // climb to the smallest node holding the point and descend from there. Sequential nearby points skip most
+        // of the descent. An empty hint starts from the root. Hints are invalidated by remove(), expire(), merge(),
+        // split_off() and snapshot(). While a snapshot still shares the path, at and contains leave hint empty.
+        T *at(const Vertex &point, viterator &hint);
+
+        bool contains(const Vertex &point, viterator &hint);
+
+        std::pair<viterator, bool> insert(viterator hint, const Vertex &point, const T &data);
+
+        // Optimistic readers for another thread than the writer. Each node is read under its sequence counter
+        // and read again if the writer changed it meanwhile, so no lock is taken. They are safe alongside a
+        // writer calling update() on points already in the tree, while no snapshot of it is alive. update() of a
+        // missing point inserts it, and inserts and removes may free memory a reader is still looking at even
+        // though they bump the counters too, so structural writes need snapshots instead. T must be trivially
+        // copyable.
+        bool read_at(const Vertex &point, T &data) const;
+
+        bool read_contains(const Vertex &point) const;
+
+        std::vector<std::pair<Vertex, T>> read_data_in_region(const Vertex &bottom_left, const Vertex &top_right) const;
+
+        // Removes one entry at point.
         bool remove(const Vertex &point);
 
-        std::vector<std::pair<Vertex, T>> data_in_region(const Vertex &bottom_left, const Vertex &top_right);
+        // Multimap mode. Removes every entry at point whose data satisfies predicate, returns how many.
+        template<typename Predicate>
+        size_t remove(const Vertex &point, Predicate predicate);
+
+        // Removes every entry whose data.expiry is at or before now, returns how many. Needs ExpiryAggregate:
+        // subtrees whose earliest expiry is later than now are skipped, fully expired ones are dropped whole.
+        template<typename TimeT>
+        size_t expire(const TimeT &now);
+
+        // Data of every entry at point.
+        std::vector<T *> equal_range(const Vertex &point);
+
+        // Number of entries at point.
+        size_t count(const Vertex &point);
+
+        std::vector<std::pair<Vertex, T>> data_in_region(const Vertex &bottom_left, const Vertex &top_right,
+                                                         traversal order = ANY_ORDER);
+
+        // Data only, without points. Leaves wholly inside are appended as a block, for an IndexQuadTree
+        // that is a copy of the leaf's index run without reading any coordinate.
+        std::vector<T> values_in_region(const Vertex &bottom_left, const Vertex &top_right);
+
+        // Points inside the polygon. Subtrees wholly inside are taken without testing their points,
+        // only leaves crossed by an edge test each point.
+        std::vector<std::pair<Vertex, T>> data_in_polygon(const Polygon &polygon);
+
+        std::vector<std::pair<Vertex, T>> data_in_polygon(const std::vector<Vertex> &polygon);
 
-        std::vector<std::pair<Vertex, T>> extract_all();
+        size_t count_in_region(const Vertex &bottom_left, const Vertex &top_right);
 
-        viterator vbegin();
+        // Cardinality estimate from stored counts, for query planning. Expands at most max_nodes nodes, those
+        // crossing the region most heavily first, and interpolates the rest by the fraction of their area
+        // inside the region. Never reads a bucket, the cost depends on max_nodes and not on the tree size.
+        CountEstimate estimate_count(const Vertex &bottom_left, const Vertex &top_right, size_t max_nodes = 8);
+
+        aggregate_type aggregate_in_region(const Vertex &bottom_left, const Vertex &top_right);
+
+        // Returns max_points points of the region, or all when it holds fewer, spread over nodes in proportion
+        // to their counts inside the region.
+        std::vector<std::pair<Vertex, T>> sample_in_region(const Vertex &bottom_left, const Vertex &top_right,
+                                                           size_t max_points);
+
+        // Writes point counts of a width x height grid over the region into buffer (row-major, row 0 at bottom_left.y).
+        // Enclosed nodes that fit in one pixel, or are smaller than one, credit their whole count to the pixel
+        // holding their center, so the cost scales with the number of pixels rather than the number of points.
+        void rasterize(const Vertex &bottom_left, const Vertex &top_right,
+                       unsigned width, unsigned height, size_t *buffer);
+
+        // Points within epsilon of the segment, ordered along it from `from` to `to`.
+        // Only nodes crossed by the segment widened by epsilon are visited, nearest first.
+        std::vector<std::pair<Vertex, T>> segment_query(const Vertex &from, const Vertex &to, long double epsilon);
+
+        // First point within epsilon of the ray from origin along direction, second is false when nothing is hit.
+        // Stops as soon as no unvisited node can hold a closer hit.
+        std::pair<std::pair<Vertex, T>, bool> raycast(const Vertex &origin, const Vertex &direction,
+                                                      long double epsilon);
+
+        // Points in increasing distance from point, one per call to next(). The cursor reads an O(1) snapshot,
+        // so it stays valid while the tree is written, and only expands the nodes the pulled points need.
+        cursor_type nearest_cursor(const Vertex &point) const;
+
+        std::vector<std::pair<Vertex, T>> extract_all(traversal order = ANY_ORDER);
+
+        viterator vbegin(traversal order = ANY_ORDER);
 
         viterator vend();
 
-        iterator begin();
+        iterator begin(traversal order = ANY_ORDER);
 
         iterator end();
 
         void data_in_subtrees(Node *node);
 
     private:
-        static Node *&child_node(const Vertex &v, Node *&node);
+        // Shares every node with other, only snapshots are built this way.
+        QuadTree(const QuadTree &other);
+
+        void swap(QuadTree &other) noexcept;
+
+        // Makes node private to this tree, copying it when a snapshot shares it, and links it to parent.
+        static Node *&own(Node *&node, Node *parent);
+
+        // Empty root with the extent of this tree.
+        Node *empty_root() const;
+
+        void merge(Node *&target, Node *&source, Node *parent);
+
+        void absorb(Node *&node, const ContainerT &bucket, bool overwrite);
+
+        // Source and target are children of source_parent and target_parent, in this tree and the new one.
+        void split_off(Node *&source, Node *&target, Node *source_parent, Node *target_parent,
+                       const Vertex &bottom_left, const Vertex &top_right);
+
+        Node *descend(const Vertex &point, Node *node);
+
+        Node *climb(const Vertex &point, Node *node) const;
+
+        // climb() from hint, or the root without one, then descend() to point. Leaves hint at the node reached
+        // when the whole path to it is private to this tree, empty otherwise.
+        Node *seek(const Vertex &point, viterator &hint);
+
+        Node **live_slot(Node *node);
+
+        // Whether a leaf holding bucket can take point without splitting.
+        bool has_room(const ContainerT &bucket, const Vertex &point) const;
+
+        bool read_point(const Vertex &point, T *data) const;
+
+        Node *&child_node(const Vertex &v, const Cell &key, Node *&node, unsigned depth);
+
+        void frame(Node *node) const;
+
+        bool on_grid(const Vertex &point) const;
 
         static Vertex new_center(int direction, Node *node);
 
         static int direction(const Vertex &point, Node *node);
 
+        int direction(const Vertex &point, const Cell &key, Node *node, unsigned depth) const;
+
+        static int direction(const Vertex &point, const Vertex &center, const Cell &key, unsigned grid_bits,
+                             unsigned depth);
+
+        Cell cell(const Vertex &point) const;
+
+        static Cell cell(const Vertex &point, const Vertex &origin, const Vertex &step, unsigned grid_bits);
+
         std::pair<viterator, bool>
-        insert(const Vertex &v, const T &data, Node *&node, QuadTree::Node *parent_node, unsigned depth);
+        insert(const Vertex &v, const Cell &key, const T &data, Node *&node, unsigned depth);
 
-        void reduce(std::stack<Node *> &nodes);
+        void reduce(PathStack &nodes);
+
+        // Merges the children of node into its bucket when they are all leaves and fit, returns whether it did.
+        bool collapse(Node *node);
+
+        template<typename TimeT>
+        size_t expire(Node *&node, Node *parent, const TimeT &now);
+
+        // Bucket capacity, a constant under a static policy.
+        unsigned bucket_limit() const {
+            if constexpr (PolicyT::is_static)
+                return PolicyT::bucket_size;
+            else
+                return max_bucket_size;
+        }
+
+        typename ContainerT::iterator insert_position(ContainerT &bucket, const PairT &entry) const;
+
+        static void refresh_aggregate(Node *node);
+
+        static void refresh_path(PathStack nodes);
 
         void add_points_to_result(Node *node, std::vector<std::pair<Vertex, T>> &results);
 
+        void add_points_to_result(Node *node, int state, traversal order, std::vector<std::pair<Vertex, T>> &results);
+
+        static void push_children(CurveStack &nodes, Node *node, int state,
+                                  traversal order);
+
+        template<typename Visitor>
+        void walk_segment(const Vertex &from, const Vertex &to, long double epsilon, Visitor visit);
+
+        static bool clip(const Vertex &from, const Vertex &delta, const Vertex &box_min, const Vertex &box_max,
+                         long double &t_enter, long double &t_exit);
+
+        static bool near_segment(const Vertex &point, const Vertex &from, const Vertex &delta, long double epsilon,
+                                 long double &t);
+
+        // Points of the subtree under node inside the region.
+        size_t count_in_region(Node *node, const Vertex &bottom_left, const Vertex &top_right);
+
+        static unsigned pixel(long double coordinate, long double origin, long double pixel_size, unsigned pixels);
+
+        // Last pixel an interval ending at the exclusive bound end covers, pixel(end) unless end is on a pixel edge.
+        static unsigned last_pixel(long double end, long double origin, long double pixel_size, unsigned pixels);
+
         static bool in_region(const Vertex &point, const Vertex &bottom_left, const Vertex &top_right);
 
         static enclosure status(const Vertex &center, const Vertex &range,
@@ -117,16 +569,6 @@ namespace qt {
 
         static void traverse(Node *node, std::queue<Node *> &nodes);
 
-        void delete_children(Node *&node) {
-            if (node == nullptr) return;
-
-            for (Node *&child: node->m_children) {
-                if (child != nullptr)
-                    delete_children(child);
-                delete child;
-            }
-        }
-
     public:
         void print_preorder() {
             std::cout << "Tree size is " << m_size << '\n';
@@ -150,47 +592,60 @@ namespace qt {
         }
     };
 
-    template<typename T, typename PairT, typename ContainerT>
-    class QuadTree<T, PairT, ContainerT>::PairComp {
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    class QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::PairComp {
     public:
         bool operator()(const PairT &lhs, const PairT &rhs) const {
             return lhs.first < rhs.first;
         }
     };
 
-    template<typename T, typename PairT, typename ContainerT>
-    class QuadTree<T, PairT, ContainerT>::TreeNodeIterator {
+    // Iterates over non-empty leaf buckets, in the given traversal order.
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    class QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::TreeNodeIterator {
         friend class QuadTree;
 
     protected:
         Node *node;
+        traversal order;
+        CurveStack nodes;
+
+        void next_leaf() {
+            node = nullptr;
+            while (!nodes.empty()) {
+                Node *top = nodes.top().first;
+                int state = nodes.top().second;
+                nodes.pop();
+                if (!top->m_leaf) {
+                    push_children(nodes, top, state, order);
+                } else if (!top->m_bucket.empty()) {
+                    node = top;
+                    return;
+                }
+            }
+        }
+
     public:
-        TreeNodeIterator() : node(nullptr) {}
+        TreeNodeIterator() : node(nullptr), order(ANY_ORDER) {}
 
-        explicit TreeNodeIterator(Node *node) : node{node} {}
+        explicit TreeNodeIterator(Node *node) : node{node}, order(ANY_ORDER) {}
 
-        TreeNodeIterator &operator++() {
-            // Use stack tree traversal method here.
-            return *this;
+        TreeNodeIterator(Node *root, traversal order) : node(nullptr), order(order) {
+            nodes.push({root, 0});
+            next_leaf();
         }
 
-        TreeNodeIterator &operator--() {
-            // Use stack tree traversal method here.
+        TreeNodeIterator &operator++() {
+            next_leaf();
             return *this;
         }
 
         TreeNodeIterator operator++(int) {
-            TreeNodeIterator tmp(this);
+            TreeNodeIterator tmp(*this);
             operator++();
             return tmp;
         }
 
-        TreeNodeIterator operator--(int) {
-            TreeNodeIterator tmp(this);
-            operator--();
-            return tmp;
-        }
-
         ContainerT &operator*() {
             return node->m_bucket;
         }
@@ -208,56 +663,295 @@ namespace qt {
         }
     };
 
-    // Must fix all of this below!!!
-    template<typename T, typename PairT, typename ContainerT>
-    class QuadTree<T, PairT, ContainerT>::TreeIterator {
+    // Iterates over every point, leaf by leaf in the given traversal order.
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    class QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::TreeIterator {
         friend class QuadTree;
 
     protected:
-        Node *node;
+        TreeNodeIterator leaf;
+        size_t index;
     public:
-        TreeIterator() : node(nullptr) {}
+        TreeIterator() : index(0) {}
 
-        explicit TreeIterator(Node *node) : node{node} {}
+        TreeIterator(Node *root, traversal order) : leaf(root, order), index(0) {}
 
         TreeIterator &operator++() {
-            // Use stack tree traversal method here.
-            return *this;
-        }
-
-        TreeIterator &operator--() {
-            // Use stack tree traversal method here.
+            if (++index >= leaf->size()) {
+                ++leaf;
+                index = 0;
+            }
             return *this;
         }
 
         TreeIterator operator++(int) {
-            TreeIterator tmp(this);
+            TreeIterator tmp(*this);
             operator++();
             return tmp;
         }
 
-        TreeIterator operator--(int) {
-            TreeIterator tmp(this);
-            operator--();
-            return tmp;
-        }
-
-        PairT &operator*() {
-            return PairT();
+        typename ContainerT::reference operator*() {
+            return (*leaf)[index];
         }
 
         PairT *operator->() {
-            return &(new PairT());
+            return &(*leaf)[index];
         }
 
         bool operator==(const TreeIterator &other) const {
-            return node->m_bucket == other.node->m_bucket;
+            return leaf == other.leaf && index == other.index;
         }
 
         bool operator!=(const TreeIterator &other) const {
-            return node != other.node;
+            return !(*this == other);
         }
     };
+
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    class QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::TreeSnapshot {
+        friend class QuadTree;
+
+    private:
+        mutable QuadTree m_tree;
+
+        explicit TreeSnapshot(const QuadTree &tree) : m_tree(tree) {}
+
+    public:
+        typedef Node node_type;
+
+        TreeSnapshot(const TreeSnapshot &other) : m_tree(other.m_tree) {}
+
+        TreeSnapshot &operator=(const TreeSnapshot &) = delete;
+
+        Node *root() const {
+            return m_tree.m_root;
+        }
+
+        size_t size() const {
+            return m_tree.size();
+        }
+
+        const T *at(const Vertex &point) const {
+            return m_tree.at(point);
+        }
+
+        bool contains(const Vertex &point) const {
+            return m_tree.contains(point);
+        }
+
+        std::vector<std::pair<Vertex, T>> data_in_region(const Vertex &bottom_left, const Vertex &top_right,
+                                                         traversal order = ANY_ORDER) const {
+            return m_tree.data_in_region(bottom_left, top_right, order);
+        }
+
+        std::vector<T> values_in_region(const Vertex &bottom_left, const Vertex &top_right) const {
+            return m_tree.values_in_region(bottom_left, top_right);
+        }
+
+        std::vector<std::pair<Vertex, T>> data_in_polygon(const Polygon &polygon) const {
+            return m_tree.data_in_polygon(polygon);
+        }
+
+        std::vector<std::pair<Vertex, T>> data_in_polygon(const std::vector<Vertex> &polygon) const {
+            return m_tree.data_in_polygon(polygon);
+        }
+
+        size_t count_in_region(const Vertex &bottom_left, const Vertex &top_right) const {
+            return m_tree.count_in_region(bottom_left, top_right);
+        }
+
+        CountEstimate estimate_count(const Vertex &bottom_left, const Vertex &top_right, size_t max_nodes = 8) const {
+            return m_tree.estimate_count(bottom_left, top_right, max_nodes);
+        }
+
+        aggregate_type aggregate_in_region(const Vertex &bottom_left, const Vertex &top_right) const {
+            return m_tree.aggregate_in_region(bottom_left, top_right);
+        }
+
+        std::vector<std::pair<Vertex, T>> sample_in_region(const Vertex &bottom_left, const Vertex &top_right,
+                                                           size_t max_points) const {
+            return m_tree.sample_in_region(bottom_left, top_right, max_points);
+        }
+
+        void rasterize(const Vertex &bottom_left, const Vertex &top_right,
+                       unsigned width, unsigned height, size_t *buffer) const {
+            m_tree.rasterize(bottom_left, top_right, width, height, buffer);
+        }
+
+        std::vector<std::pair<Vertex, T>> segment_query(const Vertex &from, const Vertex &to,
+                                                        long double epsilon) const {
+            return m_tree.segment_query(from, to, epsilon);
+        }
+
+        std::pair<std::pair<Vertex, T>, bool> raycast(const Vertex &origin, const Vertex &direction,
+                                                      long double epsilon) const {
+            return m_tree.raycast(origin, direction, epsilon);
+        }
+
+        cursor_type nearest_cursor(const Vertex &point) const {
+            return m_tree.nearest_cursor(point);
+        }
+
+        std::vector<std::pair<Vertex, T>> extract_all(traversal order = ANY_ORDER) const {
+            return m_tree.extract_all(order);
+        }
+    };
+
+    // Incremental nearest neighbours. Nodes and points share one queue ordered by squared distance, a node by
+    // the distance to its box. A point popped before every remaining box is the next nearest, so each call
+    // expands nodes only until the head of the queue is a point.
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    class QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::NearestCursor {
+        friend class QuadTree;
+
+    private:
+        static constexpr size_t no_point = std::numeric_limits<size_t>::max();
+
+        // A node when index is no_point, otherwise entry index of the node's bucket.
+        struct Entry {
+            long double distance;
+            Node *node;
+            size_t index;
+
+            bool operator>(const Entry &other) const {
+                return distance > other.distance;
+            }
+        };
+
+        QuadTree m_tree;
+        Vertex m_point;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> m_queue;
+        long double m_distance;
+
+        NearestCursor(const QuadTree &tree, const Vertex &point);
+
+        long double box_distance(const Node *node) const;
+
+    public:
+        NearestCursor(const NearestCursor &other) :
+                m_tree(other.m_tree), m_point(other.m_point), m_queue(other.m_queue), m_distance(other.m_distance) {}
+
+        NearestCursor &operator=(const NearestCursor &) = delete;
+
+        // Next nearest point, nullopt once every point was returned. Equally distant points come in any order.
+        std::optional<std::pair<Vertex, T>> next();
+
+        // Distance of the point last returned by next().
+        long double distance() const {
+            return m_distance;
+        }
+    };
+
+    // Read-only tree packed into two arrays. Nodes are stored in van Emde Boas or breadth-first order and hold
+    // no boxes, which are recomputed while descending. Points are stored in Z order so that the points of every
+    // subtree are contiguous, an enclosed subtree is copied in one go.
+    template<typename T, typename PairT, typename ContainerT, typename AggregateT, typename PolicyT>
+    class QuadTree<T, PairT, ContainerT, AggregateT, PolicyT>::FrozenQuadTree {
+        friend class QuadTree;
+
+    private:
+        static constexpr uint32_t no_child = std::numeric_limits<uint32_t>::max();
+
+        // Children are indices into m_nodes, [begin, end) are the points of the subtree.
+        struct PackedNode {
+            uint32_t children[4];
+            uint32_t begin;
+            uint32_t end;
+        };
+
+        struct Visit {
+            uint32_t index;
+            unsigned depth;
+            Vertex center;
+            Vertex range;
+        };
+
+        std::vector<PackedNode> m_nodes;
+        std::vector<std::pair<Vertex, T>> m_points;
+        Vertex m_center;
+        Vertex m_range;
+        unsigned m_grid_bits;
+        Vertex m_step;
+
+        FrozenQuadTree(const QuadTree &tree, layout order);
+
+        static uint32_t pack(const Node *node, unsigned depth, unsigned &height,
+                             std::vector<PackedNode> &nodes, std::vector<std::pair<Vertex, T>> &points);
+
+        static void veb_order(const std::vector<PackedNode> &nodes, uint32_t root, unsigned height,
+                              std::vector<uint32_t> &order);
+
+        static void nodes_at_depth(const std::vector<PackedNode> &nodes, uint32_t root, unsigned depth,
+                                   std::vector<uint32_t> &result);
+
+        static bool is_leaf(const PackedNode &node) {
+            return node.children[0] == no_child && node.children[1] == no_child &&
+                   node.children[2] == no_child && node.children[3] == no_child;
+        }
+
+        // Same arithmetic as new_center(), so boxes match the ones of the live tree exactly.
+        Visit child(const Visit &visit, int direction) const {
+            Visit next{m_nodes[visit.index].children[direction], visit.depth + 1, visit.center, visit.range / 2.0};
+            next.center.x += direction & 2 ? next.range.x : -next.range.x;
+            next.center.y += direction & 1 ? next.range.y : -next.range.y;
+            return next;
+        }
+
+        Visit root() const {
+            return {0, 0, m_center, m_range};
+        }
+
+    public:
+        size_t size() const {
+            return m_points.size();
+        }
+
+        size_t node_count() const {
+            return m_nodes.size();
+        }
+
+        const T *at(const Vertex &point) const;
+
+        // Stored point equal to point, nullptr when there is none.
+        const std::pair<Vertex, T> *find(const Vertex &point) const;
+
+        bool contains(const Vertex &point) const;
+
+        std::vector<std::pair<Vertex, T>> data_in_region(const Vertex &bottom_left, const Vertex &top_right) const;
+
+        // Calls visit(begin, end) for runs [begin, end) of indices into points() inside the region.
+        // An enclosed subtree is one run, matching neighbours in a leaf are joined.
+        template<typename Visitor>
+        void ranges_in_region(const Vertex &bottom_left, const Vertex &top_right, Visitor visit) const;
+
+        // Closest stored point, nullptr when the tree is empty.
+        const std::pair<Vertex, T> *nearest(const Vertex &point) const;
+
+        // Points in node order, the results of at(), find() and nearest() point into it.
+        const std::vector<std::pair<Vertex, T>> &points() const {
+            return m_points;
+        }
+    };
+
+    // Tree with a compile-time policy, buckets are inline arrays of the policy's bucket size.
+    template<typename T, typename PolicyT>
+    using StaticQuadTree = QuadTree<T, std::pair<Vertex, T>, small_vector<std::pair<Vertex, T>, PolicyT::bucket_size>,
+            NoAggregate<T>, PolicyT>;
+
+    // Tree whose buckets are std::pmr::vector, so nodes and bucket storage both come from the resource
+    // given to the constructor.
+    template<typename T, typename AggregateT = NoAggregate<T>>
+    using PmrQuadTree = QuadTree<T, std::pair<Vertex, T>, std::pmr::vector<std::pair<Vertex, T>>, AggregateT>;
+
+    // Tree storing only uint32_t indices into a caller-owned point array, read through accessor(index).
+    // The accessor is passed to the constructor as context, the argument before resource, and must outlive the tree.
+    template<typename AccessorT>
+    using IndexQuadTree = QuadTree<uint32_t, std::pair<Vertex, uint32_t>, IndexBucket<AccessorT>>;
+
+    // Calls callback(a, b) for every pair of points from tree_a and tree_b that satisfies predicate.
+    // Both trees are walked together, node pairs whose boxes can't match are pruned.
+    template<typename TreeA, typename TreeB, typename Predicate, typename Callback>
+    void spatial_join(TreeA &tree_a, TreeB &tree_b, const Predicate &predicate, Callback callback);
 }
 
 // Class member functions definition file
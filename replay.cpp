@@ -0,0 +1,114 @@
+#include "quadtree.h"
+#include "qttrace.h"
+#include "vec2.h"
+#include <cstdio>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+using namespace qt;
+
+// Rebuilds a tree from a trace written by QuadTree::trace() and runs its operations again,
+// then prints latency percentiles per operation, as recorded and as replayed.
+// The replayed tree stores int data in the default bucket container.
+
+static const char *op_names[] = {"load", "insert", "remove", "at", "data_in_region", "split_off", "update",
+                                 "remove_if"};
+
+static double percentile(std::vector<uint32_t> &samples, double p) {
+    if (samples.empty()) return 0;
+    size_t index = std::min(samples.size() - 1, (size_t) (p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+static void report(const char *name, const char *source, std::vector<uint32_t> &samples) {
+    double total = 0;
+    for (uint32_t sample: samples) total += sample;
+    printf("%s\t%s\t%zu\t", name, source, samples.size());
+    printf("%.0f\t", samples.empty() ? 0 : total / samples.size());
+    printf("%.0f\t", percentile(samples, 0.5));
+    printf("%.0f\t", percentile(samples, 0.9));
+    printf("%.0f\t", percentile(samples, 0.99));
+    printf("%.0f\n", samples.empty() ? 0 : (double) *std::max_element(samples.begin(), samples.end()));
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace_file\n", argv[0]);
+        return 1;
+    }
+
+    TraceReader reader(argv[1]);
+    TraceHeader header{};
+    if (!reader.header(header)) {
+        fprintf(stderr, "%s is not a quad tree trace\n", argv[1]);
+        return 1;
+    }
+
+    QuadTree<int> tree{header.center, header.range, header.bucket_size, header.depth, header.sort != 0, header.grid_bits,
+                       header.multimap != 0};
+
+    std::vector<uint32_t> recorded[TRACE_REMOVE_IF + 1];
+    std::vector<uint32_t> replayed[TRACE_REMOVE_IF + 1];
+    size_t found = 0;
+    int data = 0;
+
+    TraceEvent event{};
+    while (reader.next(event)) {
+        if (event.op > TRACE_REMOVE_IF) break;
+        if (event.op == TRACE_LOAD) {
+            tree.insert(event.a, data++);
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        switch (event.op) {
+            case TRACE_INSERT:
+                found += tree.insert(event.a, data++).second;
+                break;
+            case TRACE_REMOVE:
+                found += tree.remove(event.a);
+                break;
+            case TRACE_AT:
+                found += tree.at(event.a) != nullptr;
+                break;
+            case TRACE_REGION:
+                found += tree.data_in_region(event.a, event.b).size();
+                break;
+            case TRACE_SPLIT_OFF:
+                found += tree.split_off(event.a, event.b).size();
+                break;
+            case TRACE_UPDATE:
+                found += tree.update(event.a, data++);
+                break;
+            case TRACE_REMOVE_IF: {
+                // The replayed data can't answer the recorded predicate, the same number of entries goes.
+                uint32_t left = event.count;
+                found += tree.remove(event.a, [&left](const int &) {
+                    if (left == 0) return false;
+                    --left;
+                    return true;
+                });
+                break;
+            }
+            default:
+                break;
+        }
+        auto stop = std::chrono::steady_clock::now();
+
+        recorded[event.op].push_back(event.nanoseconds);
+        replayed[event.op].push_back(
+                (uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+    }
+
+    printf("op\tsource\tcount\tmean_ns\tp50_ns\tp90_ns\tp99_ns\tmax_ns\n");
+    for (int op = TRACE_INSERT; op <= TRACE_REMOVE_IF; ++op) {
+        if (recorded[op].empty()) continue;
+        report(op_names[op], "recorded", recorded[op]);
+        report(op_names[op], "replayed", replayed[op]);
+    }
+    printf("tree size %zu, %zu points found or changed\n", tree.size(), found);
+
+    return 0;
+}
@@ -0,0 +1,1149 @@
+#include "quadtree.h"
+#include "vec2.h"
+#ifdef __unix__
+#include "qtproto.h"
+#endif
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory_resource>
+#include <thread>
+#include <type_traits>
+
+using namespace qt;
+
+// Behaviour tests, run by ctest. Each test returns normally, failed checks are counted and printed.
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            ++failures; \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        } \
+    } while (0)
+
+typedef QuadTree<int> Tree;
+
+static std::vector<Vertex> random_points(Tree &tree, size_t count, unsigned seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    std::vector<Vertex> points;
+    for (size_t i = 0; i < count; ++i) {
+        Vertex point(coordinate(random), coordinate(random));
+        if (tree.insert(point, (int) i).second) points.push_back(point);
+    }
+    return points;
+}
+
+static bool inside(const Vertex &point, const Vertex &bottom_left, const Vertex &top_right) {
+    return point.x >= bottom_left.x && point.x < top_right.x && point.y >= bottom_left.y && point.y < top_right.y;
+}
+
+// Every child links back to the node holding it, the root to nothing.
+static bool parents_exact(Tree &tree) {
+    if (tree.root()->parent() != nullptr) return false;
+    std::vector<Tree::node_type *> nodes{tree.root()};
+    while (!nodes.empty()) {
+        Tree::node_type *node = nodes.back();
+        nodes.pop_back();
+        for (int i = 0; i < 4; ++i) {
+            Tree::node_type *child = node->children()[i];
+            if (child == nullptr) continue;
+            if (child->parent() != node) return false;
+            nodes.push_back(child);
+        }
+    }
+    return true;
+}
+
+static void test_spatial_join() {
+    Tree a{{0, 0}, {101, 101}, 4, 16};
+    Tree b{{0, 0}, {101, 101}, 2, 16};
+    auto points_a = random_points(a, 800, 2);
+    auto points_b = random_points(b, 800, 3);
+
+    // Every pair the join reports satisfies the predicate, and it finds as many as a nested loop.
+    for (long double radius: {0.0L, 1.0L, 5.0L}) {
+        WithinDistance within(radius);
+        size_t expected = 0;
+        for (auto &pa: points_a)
+            for (auto &pb: points_b)
+                expected += within(pa, pb);
+        size_t joined = 0;
+        spatial_join(a, b, within, [&](const std::pair<Vertex, int> &pa, const std::pair<Vertex, int> &pb) {
+            CHECK(within(pa.first, pb.first));
+            ++joined;
+        });
+        CHECK(joined == expected);
+    }
+
+    WithinBox box({2, 0.5});
+    size_t expected = 0;
+    for (auto &pa: points_a)
+        for (auto &pb: points_b)
+            expected += box(pa, pb);
+    size_t joined = 0;
+    spatial_join(a, b, box, [&](const std::pair<Vertex, int> &, const std::pair<Vertex, int> &) { ++joined; });
+    CHECK(joined == expected);
+    CHECK(expected > 0);
+}
+
+static void test_aggregates() {
+    typedef std::pair<Vertex, int> Entry;
+    QuadTree<int, Entry, std::vector<Entry>, SumAggregate<int>> sums{{0, 0}, {101, 101}, 4, 16};
+    QuadTree<int, Entry, std::vector<Entry>, MinAggregate<int>> mins{{0, 0}, {101, 101}, 4, 16};
+    QuadTree<int, Entry, std::vector<Entry>, MaxAggregate<int>> maxes{{0, 0}, {101, 101}, 4, 16};
+    std::mt19937 random(4);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    std::vector<Entry> entries;
+    for (int i = 0; i < 3000; ++i) {
+        Vertex point(coordinate(random), coordinate(random));
+        int data = (int) (random() % 1000) - 500;
+        if (!sums.insert(point, data).second) continue;
+        mins.insert(point, data);
+        maxes.insert(point, data);
+        entries.emplace_back(point, data);
+    }
+    // Removes and updates keep the counts and aggregates of the path.
+    for (size_t i = 0; i < entries.size(); i += 7) {
+        sums.remove(entries[i].first);
+        mins.remove(entries[i].first);
+        maxes.remove(entries[i].first);
+    }
+    for (size_t i = 3; i < entries.size(); i += 7) {
+        entries[i].second += 1000;
+        sums.update(entries[i].first, entries[i].second);
+        mins.update(entries[i].first, entries[i].second);
+        maxes.update(entries[i].first, entries[i].second);
+    }
+
+    Vertex regions[][2] = {{{-100, -100}, {100, 100}}, {{-30, -70}, {45, 12}}, {{10, 10}, {11, 11}}};
+    for (auto &region: regions) {
+        size_t count = 0;
+        int sum = 0, min = std::numeric_limits<int>::max(), max = std::numeric_limits<int>::lowest();
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (i % 7 == 0 || !inside(entries[i].first, region[0], region[1])) continue;
+            ++count;
+            sum += entries[i].second;
+            min = std::min(min, entries[i].second);
+            max = std::max(max, entries[i].second);
+        }
+        CHECK(sums.count_in_region(region[0], region[1]) == count);
+        CHECK(sums.aggregate_in_region(region[0], region[1]) == sum);
+        CHECK(mins.aggregate_in_region(region[0], region[1]) == min);
+        CHECK(maxes.aggregate_in_region(region[0], region[1]) == max);
+    }
+    CHECK(sums.root()->count() == sums.size());
+}
+
+static void test_rasterize() {
+    Tree tree{{0, 0}, {128, 128}, 4, 16};
+    random_points(tree, 5000, 5);
+
+    // Pixels on node boundaries: every pixel holds exactly the points of its box.
+    unsigned width = 16, height = 8;
+    std::vector<size_t> buffer(width * height);
+    tree.rasterize({-128, -128}, {128, 128}, width, height, buffer.data());
+    for (unsigned y = 0; y < height; ++y) {
+        for (unsigned x = 0; x < width; ++x) {
+            Vertex bottom_left(-128 + 16.0L * x, -128 + 32.0L * y);
+            CHECK(buffer[y * width + x] == tree.count_in_region(bottom_left, bottom_left + Vertex(16, 32)));
+        }
+    }
+
+    // Any viewport: nodes credited whole may land in a neighbouring pixel, but no point is lost or counted twice.
+    Vertex bottom_left{-77.3, -12.9}, top_right{61.1, 90.4};
+    width = 37;
+    height = 23;
+    buffer.assign(width * height, 1);
+    tree.rasterize(bottom_left, top_right, width, height, buffer.data());
+    size_t total = 0;
+    for (size_t count: buffer) total += count;
+    CHECK(total == tree.count_in_region(bottom_left, top_right));
+}
+
+static void test_snapshots() {
+    Tree tree{{0, 0}, {101, 101}, 4, 16};
+    auto points = random_points(tree, 2000, 9);
+    Tree::snapshot_type before = tree.snapshot();
+    CHECK(before.root() == tree.root());
+
+    // Writes copy the nodes they touch, the snapshot keeps seeing the old tree.
+    for (size_t i = 0; i < points.size(); i += 2) tree.remove(points[i]);
+    for (size_t i = 1; i < points.size(); i += 2) tree.update(points[i], -1);
+    auto added = random_points(tree, 500, 10);
+    CHECK(before.root() != tree.root());
+    CHECK(before.size() == points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        const int *data = before.at(points[i]);
+        CHECK(data != nullptr && *data == (int) i);
+    }
+    for (auto &point: added) CHECK(!before.contains(point));
+    CHECK(before.count_in_region({-101, -101}, {101, 101}) == points.size());
+    CHECK(parents_exact(tree));
+
+    // A second snapshot shares with both, and outlives the first.
+    Tree::snapshot_type after = tree.snapshot();
+    { Tree::snapshot_type gone = before; }
+    tree.insert({0.5, 0.5}, 7);
+    CHECK(!after.contains({0.5, 0.5}));
+    CHECK(after.size() == tree.size() - 1);
+    CHECK(tree.count_in_region({-101, -101}, {101, 101}) == tree.size());
+}
+
+static void test_curve_order() {
+    // One point per cell of a full 16 x 16 grid, each in a leaf of its own.
+    Tree tree{{0, 0}, {8, 8}, 1, 16};
+    for (int x = 0; x < 16; ++x)
+        for (int y = 0; y < 16; ++y)
+            tree.insert({x - 7.5, y - 7.5}, x * 16 + y);
+
+    auto cell = [](const std::pair<Vertex, int> &entry) {
+        return std::make_pair((int) (entry.first.x + 8), (int) (entry.first.y + 8));
+    };
+    // Morton code with x above y at each level, the child index order (x << 1 | y).
+    auto morton = [](std::pair<int, int> c) {
+        unsigned code = 0;
+        for (int bit = 3; bit >= 0; --bit) code = code << 2 | ((c.first >> bit) & 1) << 1 | ((c.second >> bit) & 1);
+        return code;
+    };
+
+    auto z = tree.extract_all(Z_ORDER);
+    CHECK(z.size() == 256);
+    for (size_t i = 0; i < z.size(); ++i) CHECK(morton(cell(z[i])) == i);
+
+    // Consecutive points of a Hilbert curve are in neighbouring cells.
+    auto hilbert = tree.extract_all(HILBERT_ORDER);
+    CHECK(hilbert.size() == 256);
+    std::vector<bool> seen(256);
+    for (size_t i = 0; i < hilbert.size(); ++i) {
+        seen[hilbert[i].second] = true;
+        if (i == 0) continue;
+        auto a = cell(hilbert[i - 1]), b = cell(hilbert[i]);
+        CHECK(std::abs(a.first - b.first) + std::abs(a.second - b.second) == 1);
+    }
+    CHECK(std::count(seen.begin(), seen.end(), true) == 256);
+
+    // Region queries and iteration follow the same curves.
+    auto region = tree.data_in_region({-8, -8}, {8, 8}, HILBERT_ORDER);
+    CHECK(region.size() == hilbert.size());
+    for (size_t i = 0; i < region.size() && i < hilbert.size(); ++i) CHECK(region[i].first == hilbert[i].first);
+    size_t index = 0;
+    for (auto it = tree.begin(Z_ORDER); it != tree.end(); ++it, ++index)
+        CHECK(index < z.size() && it->first == z[index].first);
+    CHECK(index == z.size());
+}
+
+// Every point of every leaf lies in the leaf's box, bottom and left edges included.
+static bool points_in_leaves(Tree &tree, unsigned &deepest) {
+    std::vector<Tree::node_type *> nodes{tree.root()};
+    deepest = 0;
+    while (!nodes.empty()) {
+        Tree::node_type *node = nodes.back();
+        nodes.pop_back();
+        deepest = std::max(deepest, node->depth());
+        for (auto const &entry: node->bucket())
+            if (!inside(entry.first, node->bottom_left(), node->top_right())) return false;
+        for (int i = 0; i < 4; ++i)
+            if (node->child(i) != nullptr) nodes.push_back(node->child(i));
+    }
+    return true;
+}
+
+static void test_grid_descent() {
+    // A 2^48 grid over [-1, 1), neighbouring cells are only told apart at the last level.
+    Tree tree{{0, 0}, {1, 1}, 1, 64, false, 48};
+    long double step = 0x1p-47L;
+    std::vector<Vertex> points;
+    for (int i = 0; i < 8; ++i) {
+        points.emplace_back(0.25L + i * step, 0.25L);
+        points.emplace_back(-step * i, 0.5L + step * (i % 2));
+    }
+    for (size_t i = 0; i < points.size(); ++i) CHECK(tree.insert(points[i], (int) i).second);
+    CHECK(!tree.insert({0.25L + step / 2, 0.25L}, 0).second);
+    CHECK(!tree.insert({0.1L, 0.25L}, 0).second);
+    unsigned deepest = 0;
+    CHECK(points_in_leaves(tree, deepest));
+    CHECK(deepest == 48);
+    for (size_t i = 0; i < points.size(); ++i) CHECK(tree.at(points[i]) != nullptr && *tree.at(points[i]) == (int) i);
+    CHECK(tree.count_in_region({0.25L, 0.25L}, {0.25L + 4 * step, 0.25L + step}) == 4);
+
+    // The depth limit is capped at the grid, and points on the center lines go up and right.
+    Tree coarse{{0, 0}, {8, 8}, 1, 60, false, 4};
+    CHECK(coarse.insert({0, 0}, 0).second);
+    CHECK(coarse.insert({-1, 0}, 1).second);
+    CHECK(coarse.insert({0, -1}, 2).second);
+    CHECK(coarse.insert({-1, -1}, 3).second);
+    CHECK(points_in_leaves(coarse, deepest));
+    CHECK(deepest <= 4);
+    CHECK(coarse.root()->child(TOP_RIGHT) != nullptr && coarse.root()->child(TOP_RIGHT)->count() == 1);
+}
+
+static void test_small_vector() {
+    typedef small_vector<std::string, 2> Strings;
+    Strings inline_strings;
+    inline_strings.push_back("a");
+    inline_strings.push_back("b");
+    CHECK(inline_strings.capacity() == 2);
+
+    // Growing moves the elements to the heap, inserts shift them in place.
+    Strings strings = inline_strings;
+    strings.insert(strings.begin(), "c");
+    strings.insert(strings.begin() + 1, strings[2]);
+    strings.push_back("d");
+    CHECK(strings.size() == 5 && strings.capacity() > 2);
+    CHECK(strings[0] == "c" && strings[1] == "b" && strings[2] == "a" && strings[3] == "b" && strings[4] == "d");
+    strings.erase(strings.begin() + 1);
+    CHECK(strings.size() == 4 && strings[1] == "a" && strings.back() == "d");
+    strings.pop_back();
+    CHECK(strings.size() == 3 && strings.back() == "b");
+
+    // Moving an inline vector moves its elements, moving a heap one takes its buffer.
+    Strings moved_inline(std::move(inline_strings));
+    CHECK(moved_inline.size() == 2 && moved_inline[1] == "b" && inline_strings.empty());
+    const std::string *buffer = &strings[0];
+    Strings moved_heap(std::move(strings));
+    CHECK(&moved_heap[0] == buffer && moved_heap.size() == 3 && strings.empty() && strings.capacity() == 2);
+    moved_inline = moved_heap;
+    CHECK(moved_inline.size() == 3 && moved_inline[0] == "c");
+    moved_heap = std::move(moved_inline);
+    CHECK(moved_heap.size() == 3 && moved_heap[2] == "b");
+
+    // As the bucket of a tree.
+    QuadTree<int, std::pair<Vertex, int>, small_vector<std::pair<Vertex, int>, 4>> tree{{0, 0}, {101, 101}, 4, 16};
+    std::vector<Vertex> points;
+    for (int i = 0; i < 500; ++i) {
+        Vertex point((i * 37) % 200 - 100, (i * 91) % 200 - 100);
+        if (tree.insert(point, i).second) points.push_back(point);
+    }
+    for (size_t i = 0; i < points.size(); i += 3) CHECK(tree.remove(points[i]));
+    size_t found = 0;
+    for (size_t i = 0; i < points.size(); ++i) found += tree.contains(points[i]) == (i % 3 != 0);
+    CHECK(found == points.size());
+    CHECK(tree.count_in_region({-101, -101}, {101, 101}) == tree.size());
+}
+
+// Shape of a tree: node count, deepest node and largest bucket.
+template<typename TreeT>
+static std::vector<size_t> shape(TreeT &tree) {
+    std::vector<typename TreeT::node_type *> nodes{tree.root()};
+    size_t count = 0, deepest = 0, largest = 0;
+    while (!nodes.empty()) {
+        auto node = nodes.back();
+        nodes.pop_back();
+        ++count;
+        deepest = std::max<size_t>(deepest, node->depth());
+        largest = std::max<size_t>(largest, node->bucket().size());
+        for (int i = 0; i < 4; ++i)
+            if (node->child(i) != nullptr) nodes.push_back(node->child(i));
+    }
+    return {count, deepest, largest};
+}
+
+static void test_policy() {
+    // The policy wins over the constructor arguments, the tree matches a runtime one built with its values.
+    StaticQuadTree<int, Policy<4, 8, true>> fixed{{0, 0}, {101, 101}, 100, 30, false};
+    Tree runtime{{0, 0}, {101, 101}, 4, 8, true};
+    std::mt19937 random(11);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    std::vector<Vertex> points;
+    for (int i = 0; i < 3000; ++i) {
+        Vertex point(coordinate(random), coordinate(random));
+        bool inserted = fixed.insert(point, i).second;
+        CHECK(inserted == runtime.insert(point, i).second);
+        if (inserted) points.push_back(point);
+    }
+    for (size_t i = 0; i < points.size(); i += 4) {
+        CHECK(fixed.remove(points[i]));
+        runtime.remove(points[i]);
+    }
+    CHECK(fixed.size() == runtime.size());
+    CHECK(shape(fixed) == shape(runtime));
+    CHECK(shape(fixed)[1] <= 8);
+
+    // Sorted buckets.
+    std::vector<decltype(fixed)::node_type *> nodes{fixed.root()};
+    while (!nodes.empty()) {
+        auto node = nodes.back();
+        nodes.pop_back();
+        auto &bucket = node->bucket();
+        CHECK(std::is_sorted(bucket.begin(), bucket.end(), [](const std::pair<Vertex, int> &a,
+                                                             const std::pair<Vertex, int> &b) {
+            return a.first < b.first;
+        }));
+        for (int i = 0; i < 4; ++i)
+            if (node->child(i) != nullptr) nodes.push_back(node->child(i));
+    }
+    Vertex bottom_left{-40, -5}, top_right{33, 70};
+    CHECK(fixed.count_in_region(bottom_left, top_right) == runtime.count_in_region(bottom_left, top_right));
+    CHECK(fixed.data_in_region(bottom_left, top_right).size() == runtime.data_in_region(bottom_left, top_right).size());
+}
+
+static void test_freeze() {
+    Tree tree{{0, 0}, {101, 101}, 4, 16};
+    auto points = random_points(tree, 3000, 12);
+    std::mt19937 random(13);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+
+    for (layout order: {VEB_LAYOUT, BFS_LAYOUT}) {
+        Tree::frozen_type frozen = tree.freeze(order);
+        CHECK(frozen.size() == tree.size());
+        for (auto &point: points) {
+            const int *data = frozen.at(point);
+            CHECK(data != nullptr && *data == *tree.at(point));
+        }
+        CHECK(!frozen.contains({1000, 1000}));
+        CHECK(frozen.find({points[0].x + 1e-9, points[0].y}) == nullptr);
+
+        for (int i = 0; i < 20; ++i) {
+            Vertex a(coordinate(random), coordinate(random)), b(coordinate(random), coordinate(random));
+            Vertex bottom_left(std::min(a.x, b.x), std::min(a.y, b.y));
+            Vertex top_right(std::max(a.x, b.x), std::max(a.y, b.y));
+            size_t count = tree.count_in_region(bottom_left, top_right);
+            CHECK(frozen.data_in_region(bottom_left, top_right).size() == count);
+            size_t in_runs = 0;
+            frozen.ranges_in_region(bottom_left, top_right, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t j = begin; j < end; ++j) CHECK(inside(frozen.points()[j].first, bottom_left, top_right));
+                in_runs += end - begin;
+            });
+            CHECK(in_runs == count);
+
+            // Nearest against a scan.
+            Vertex query(coordinate(random), coordinate(random));
+            long double best = std::numeric_limits<long double>::max();
+            for (auto &point: points) {
+                Vertex d = point - query;
+                best = std::min(best, d.x * d.x + d.y * d.y);
+            }
+            const std::pair<Vertex, int> *nearest = frozen.nearest(query);
+            CHECK(nearest != nullptr);
+            if (nearest != nullptr) {
+                Vertex d = nearest->first - query;
+                CHECK(d.x * d.x + d.y * d.y == best);
+            }
+        }
+    }
+
+    // The frozen copy doesn't follow later writes.
+    Tree::frozen_type frozen = tree.freeze();
+    tree.remove(points[0]);
+    CHECK(frozen.contains(points[0]));
+    CHECK(Tree{}.freeze().nearest({0, 0}) == nullptr);
+}
+
+// Position along from + delta * t of the closest point of the segment, and whether point is within epsilon.
+static bool near(const Vertex &point, const Vertex &from, const Vertex &delta, long double epsilon, long double &t) {
+    long double length = delta.x * delta.x + delta.y * delta.y;
+    Vertex offset = point - from;
+    t = std::max(0.0L, std::min(1.0L, (offset.x * delta.x + offset.y * delta.y) / length));
+    Vertex gap = offset - delta * t;
+    return gap.x * gap.x + gap.y * gap.y <= epsilon * epsilon;
+}
+
+static void test_segments() {
+    Tree tree{{0, 0}, {101, 101}, 4, 16};
+    auto points = random_points(tree, 4000, 14);
+
+    Vertex segments[][2] = {{{-90, -80}, {85, 70}}, {{50, -100}, {-20, 99}}, {{-5, 3}, {-5.5, 3.2}}};
+    for (auto &segment: segments) {
+        Vertex delta = segment[1] - segment[0];
+        std::vector<std::pair<long double, Vertex>> expected;
+        long double t;
+        for (auto &point: points)
+            if (near(point, segment[0], delta, 2, t)) expected.emplace_back(t, point);
+        std::sort(expected.begin(), expected.end(), [](const std::pair<long double, Vertex> &a,
+                                                       const std::pair<long double, Vertex> &b) {
+            return a.first < b.first;
+        });
+
+        auto found = tree.segment_query(segment[0], segment[1], 2);
+        CHECK(found.size() == expected.size());
+        for (size_t i = 0; i < found.size() && i < expected.size(); ++i) CHECK(found[i].first == expected[i].second);
+    }
+
+    // The ray hits the point closest to its origin along it, it is cut where it leaves the tree.
+    Vertex origin{-100, -60}, direction{3, 1};
+    Vertex to = origin + direction * 67.0L;
+    long double first_t = 2, t;
+    Vertex first;
+    for (auto &point: points) {
+        if (near(point, origin, to - origin, 0.5, t) && t < first_t) {
+            first_t = t;
+            first = point;
+        }
+    }
+    auto hit = tree.raycast(origin, direction, 0.5);
+    CHECK(hit.second && first_t <= 1 && hit.first.first == first);
+    CHECK(!tree.raycast({-100, 150}, {1, 0}, 0.5).second);
+}
+
+static void test_polygon() {
+    Tree tree{{0, 0}, {101, 101}, 4, 16};
+    auto points = random_points(tree, 4000, 15);
+
+    // A concave star and a self-intersecting bow tie, under the even-odd rule.
+    std::vector<Vertex> star;
+    for (int i = 0; i < 10; ++i) {
+        long double angle = i * 3.14159265358979323846L / 5, radius = i % 2 == 0 ? 90 : 30;
+        star.emplace_back(radius * std::cos(angle), radius * std::sin(angle));
+    }
+    std::vector<Vertex> bow_tie{{-80, -80}, {80, 80}, {80, -80}, {-80, 80}};
+
+    for (auto &vertices: {star, bow_tie}) {
+        Polygon polygon(vertices);
+        size_t expected = 0;
+        for (auto &point: points) expected += polygon.contains(point);
+        auto found = tree.data_in_polygon(polygon);
+        CHECK(found.size() == expected);
+        for (auto &entry: found) CHECK(polygon.contains(entry.first));
+        CHECK(tree.data_in_polygon(vertices).size() == expected);
+        CHECK(expected > 0);
+    }
+
+    Polygon square({{0, 0}, {10, 0}, {10, 10}, {0, 10}});
+    CHECK(square.contains({5, 5}) && !square.contains({15, 5}) && !square.contains({5, -1}));
+    CHECK(square.status({2, 2}, {3, 3}) == IN_BOUND);
+    CHECK(square.status({9, 9}, {11, 11}) == PARTIAL_BOUND);
+    CHECK(square.status({20, 20}, {30, 30}) == OUT_OF_BOUND);
+    CHECK(Polygon({{0, 0}, {1, 1}}).status({0, 0}, {1, 1}) == OUT_OF_BOUND);
+    CHECK(tree.data_in_polygon(std::vector<Vertex>{}).empty());
+}
+
+struct PointAccessor {
+    const std::vector<Vertex> *points;
+
+    Vertex operator()(uint32_t index) const { return (*points)[index]; }
+};
+
+static void test_index_bucket() {
+    std::mt19937 random(16);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    std::vector<Vertex> points;
+    for (int i = 0; i < 3000; ++i) points.emplace_back(coordinate(random), coordinate(random));
+    PointAccessor accessor{&points};
+    IndexQuadTree<PointAccessor> tree{{0, 0}, {101, 101}, 8, 16, false, 0, false, &accessor};
+    for (uint32_t i = 0; i < points.size(); ++i) CHECK(tree.insert(points[i], i).second);
+    for (uint32_t i = 0; i < points.size(); i += 5) CHECK(tree.remove(points[i]));
+
+    Vertex bottom_left{-63, -20}, top_right{48, 71};
+    std::vector<uint32_t> expected;
+    for (uint32_t i = 0; i < points.size(); ++i)
+        if (i % 5 != 0 && inside(points[i], bottom_left, top_right)) expected.push_back(i);
+    std::vector<uint32_t> values = tree.values_in_region(bottom_left, top_right);
+    std::sort(values.begin(), values.end());
+    CHECK(values == expected);
+    for (auto &entry: tree.data_in_region(bottom_left, top_right)) CHECK(entry.first == points[entry.second]);
+    for (uint32_t i = 1; i < points.size(); i += 5) CHECK(tree.at(points[i]) != nullptr && *tree.at(points[i]) == i);
+
+    // Split off and merged back, the leaves keep reading the same array.
+    IndexQuadTree<PointAccessor> part = tree.split_off(bottom_left, top_right);
+    CHECK(part.size() == expected.size());
+    CHECK(tree.merge(std::move(part)) == 0);
+    values = tree.values_in_region(bottom_left, top_right);
+    std::sort(values.begin(), values.end());
+    CHECK(values == expected);
+}
+
+// Counts what is taken from and given back to the default resource.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    size_t allocated = 0;
+    size_t live = 0;
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        ++allocated;
+        live += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        live -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+static void test_memory_resource() {
+    CountingResource resource;
+    {
+        PmrQuadTree<int> tree{{0, 0}, {101, 101}, 4, 16, false, 0, false, {}, &resource};
+        std::vector<Vertex> points;
+        for (int i = 0; i < 2000; ++i) {
+            Vertex point((i * 53) % 200 - 100.5, (i * 29) % 200 - 100.25);
+            if (tree.insert(point, i).second) points.push_back(point);
+        }
+        size_t after_fill = resource.allocated;
+        CHECK(after_fill > points.size() / 4);
+
+        // Copies made for a snapshot come from the same resource and go back to it.
+        {
+            PmrQuadTree<int>::snapshot_type snapshot = tree.snapshot();
+            for (size_t i = 0; i < points.size(); i += 2) tree.remove(points[i]);
+            CHECK(resource.allocated > after_fill);
+            CHECK(snapshot.size() == points.size());
+        }
+        for (size_t i = 1; i < points.size(); i += 2) CHECK(tree.contains(points[i]));
+        PmrQuadTree<int> part = tree.split_off({-50, -50}, {50, 50});
+        CHECK(tree.merge(std::move(part)) == 0);
+    }
+    CHECK(resource.live == 0);
+
+    // A monotonic buffer hands out memory and frees nothing until it goes.
+    std::pmr::monotonic_buffer_resource monotonic;
+    PmrQuadTree<int> tree{{0, 0}, {101, 101}, 4, 16, false, 0, false, {}, &monotonic};
+    for (int i = 0; i < 500; ++i) tree.insert({(i * 7) % 200 - 100.0, (i * 13) % 200 - 100.0}, i);
+    CHECK(tree.count_in_region({-101, -101}, {101, 101}) == tree.size());
+}
+
+static void test_expire() {
+    typedef Expiring<int> Ping;
+    typedef QuadTree<Ping, std::pair<Vertex, Ping>, std::vector<std::pair<Vertex, Ping>>, ExpiryAggregate<Ping>> Pings;
+    Pings tree{{0, 0}, {101, 101}, 4, 16};
+    std::mt19937 random(17);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    std::vector<std::pair<Vertex, int64_t>> entries;
+    for (int i = 0; i < 3000; ++i) {
+        Vertex point(coordinate(random), coordinate(random));
+        // The left half expires early, so whole subtrees go at once.
+        int64_t expiry = point.x < 0 ? random() % 100 : 100 + random() % 900;
+        if (tree.insert(point, Ping{i, expiry}).second) entries.emplace_back(point, expiry);
+    }
+
+    for (int64_t now: {-1, 50, 99, 500, 2000}) {
+        size_t expected = 0;
+        for (auto &entry: entries) expected += entry.second > now;
+        size_t before = tree.size();
+        CHECK(tree.expire(now) == before - expected);
+        CHECK(tree.size() == expected);
+        CHECK(tree.count_in_region({-101, -101}, {101, 101}) == expected);
+        for (auto &entry: entries) CHECK(tree.contains(entry.first) == (entry.second > now));
+        if (expected > 0) CHECK(tree.root()->aggregate().earliest > now);
+    }
+    CHECK(tree.size() == 0 && tree.root()->is_leaf());
+}
+
+static void test_estimate_count() {
+    Tree tree{{0, 0}, {101, 101}, 4, 16};
+    random_points(tree, 20000, 18);
+    std::mt19937 random(19);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+
+    for (int i = 0; i < 30; ++i) {
+        Vertex a(coordinate(random), coordinate(random)), b(coordinate(random), coordinate(random));
+        Vertex bottom_left(std::min(a.x, b.x), std::min(a.y, b.y));
+        Vertex top_right(std::max(a.x, b.x), std::max(a.y, b.y));
+        size_t count = tree.count_in_region(bottom_left, top_right);
+        double last_width = std::numeric_limits<double>::max();
+        for (size_t max_nodes: {1, 8, 64, 100000}) {
+            CountEstimate estimate = tree.estimate_count(bottom_left, top_right, max_nodes);
+            CHECK(estimate.low <= count && count <= estimate.high);
+            CHECK(estimate.low <= estimate.count && estimate.count <= estimate.high);
+            // More nodes never loosen the bounds.
+            CHECK(estimate.high - estimate.low <= last_width);
+            last_width = estimate.high - estimate.low;
+        }
+        // Points are uniform, so the area estimate is close once the boundary is expanded a little.
+        CountEstimate estimate = tree.estimate_count(bottom_left, top_right, 64);
+        CHECK(std::abs(estimate.count - count) <= 0.1 * count + 50);
+    }
+    CountEstimate outside = tree.estimate_count({200, 200}, {300, 300});
+    CHECK(outside.count == 0 && outside.high == 0);
+    CountEstimate all = tree.estimate_count({-101, -101}, {101, 101}, 1);
+    CHECK(all.low == tree.size() && all.high == tree.size());
+}
+
+static void test_sample() {
+    Tree tree{{0, 0}, {101, 101}, 4, 16};
+    random_points(tree, 5000, 1);
+
+    // The region crosses nodes that hold many points outside it.
+    Vertex bottom_left{-90, -10}, top_right{-60, 80};
+    size_t in_region = tree.count_in_region(bottom_left, top_right);
+    CHECK(in_region >= 200);
+
+    for (size_t max_points: {1, 10, 100, 200}) {
+        auto sample = tree.sample_in_region(bottom_left, top_right, max_points);
+        CHECK(sample.size() == max_points);
+        for (auto &entry: sample) {
+            CHECK(inside(entry.first, bottom_left, top_right));
+            CHECK(tree.at(entry.first) != nullptr && *tree.at(entry.first) == entry.second);
+        }
+    }
+
+    // Fewer points than asked for: all of them.
+    CHECK(tree.sample_in_region(bottom_left, top_right, in_region + 10).size() == in_region);
+    CHECK(tree.sample_in_region({200, 200}, {300, 300}, 10).empty());
+}
+
+static void test_hinted_insert() {
+    Tree tree{{0, 0}, {100, 100}, 4, 10};
+    auto hint = tree.insert({1, 1}, 1).first;
+    CHECK(tree.insert(hint, {1.5, 1.5}, 2).second);
+    CHECK(!tree.insert(hint, {1.5, 1.5}, 3).second);
+
+    // A hint from before a snapshot must not skip the duplicate check.
+    auto snapshot = tree.snapshot();
+    CHECK(tree.insert({2, 2}, 4).second);
+    CHECK(!tree.insert(hint, {2, 2}, 5).second);
+    CHECK(tree.insert(hint, {3, 3}, 6).second);
+    CHECK(tree.size() == 4);
+    CHECK(tree.count_in_region({-100, -100}, {100, 100}) == 4);
+    CHECK(*tree.at({2, 2}) == 4);
+    CHECK(snapshot.size() == 2);
+
+    // Hints handed back by at() and contains() keep working along sequential points.
+    Tree line{{0, 0}, {100, 100}, 2, 16};
+    Tree::viterator walk;
+    for (int i = 0; i < 500; ++i) CHECK(line.insert(walk, {-90 + i * 0.3, -80 + i * 0.2}, i).second);
+    for (int i = 0; i < 500; ++i) {
+        int *data = line.at({-90 + i * 0.3, -80 + i * 0.2}, walk);
+        CHECK(data != nullptr && *data == i);
+    }
+    CHECK(line.size() == 500);
+}
+
+static void test_merge_split_off() {
+    Tree left{{0, 0}, {101, 101}, 4, 16};
+    Tree right{{0, 0}, {101, 101}, 4, 16};
+    auto left_points = random_points(left, 2000, 2);
+    auto right_points = random_points(right, 2000, 3);
+
+    size_t expected = left.size();
+    for (auto &point: right_points)
+        if (!left.contains(point)) ++expected;
+
+    left.merge(std::move(right));
+    CHECK(right.size() == 0);
+    CHECK(left.size() == expected);
+    CHECK(left.count_in_region({-101, -101}, {101, 101}) == expected);
+    for (auto &point: right_points) CHECK(left.contains(point));
+
+    Vertex bottom_left{-50, -50}, top_right{30, 70};
+    size_t in_region = left.count_in_region(bottom_left, top_right);
+    Tree part = left.split_off(bottom_left, top_right);
+    CHECK(part.size() == in_region);
+    CHECK(left.size() == expected - in_region);
+    CHECK(left.count_in_region(bottom_left, top_right) == 0);
+    for (auto &point: left_points) CHECK(left.contains(point) != part.contains(point));
+    for (auto &entry: part.data_in_region({-101, -101}, {101, 101}))
+        CHECK(inside(entry.first, bottom_left, top_right));
+
+    // Move assignment releases the old nodes and leaves the source empty.
+    size_t kept = left.size();
+    part = std::move(left);
+    CHECK(part.size() == kept);
+    CHECK(left.size() == 0);
+    CHECK(left.insert({1, 1}, 1).second);
+    CHECK(left.size() == 1);
+    static_assert(std::is_nothrow_move_constructible<Tree>::value, "trees move without throwing");
+    static_assert(std::is_nothrow_move_assignable<Tree>::value, "trees move without throwing");
+}
+
+static void test_merge_fallback() {
+    // Different extents: points outside this tree stay in other.
+    Tree small{{0, 0}, {50, 50}, 4, 16};
+    Tree large{{0, 0}, {101, 101}, 4, 16};
+    auto points = random_points(large, 1000, 6);
+    size_t fits = 0;
+    for (auto &point: points) fits += inside(point, {-50, -50}, {50, 50});
+
+    size_t rejected = small.merge(std::move(large));
+    CHECK(small.size() == fits);
+    CHECK(rejected == points.size() - fits);
+    CHECK(large.size() == rejected);
+    for (auto &point: points) CHECK(small.contains(point) != large.contains(point));
+
+    // Same extent but other limits: grafting would leave nodes deeper and fuller than this tree allows.
+    Tree shallow{{0, 0}, {101, 101}, 2, 6};
+    Tree deep{{0, 0}, {101, 101}, 64, 30};
+    std::vector<Vertex> deep_points;
+    for (int i = 0; i < 200; ++i) {
+        deep_points.emplace_back(-95 + (i % 20) * 9.5, -95 + (i / 20) * 9.5);
+        deep.insert(deep_points.back(), i);
+    }
+    CHECK(shallow.merge(std::move(deep)) == 0);
+    CHECK(deep.size() == 0);
+    CHECK(shallow.size() == deep_points.size());
+    // Each point has a cell of its own at depth 6, a neighbour fits in its bucket.
+    size_t inserted = 0;
+    for (auto &point: deep_points) inserted += shallow.insert({point.x + 0.01, point.y}, 0).second;
+    CHECK(inserted == deep_points.size());
+
+    // A cluster deeper than depth 4 only has room for one point there.
+    Tree coarse{{0, 0}, {101, 101}, 1, 4};
+    Tree fine{{0, 0}, {101, 101}, 8, 30};
+    for (int i = 0; i < 100; ++i) fine.insert({10 + i * 1e-3, 10 + i * 2e-3}, i);
+    CHECK(coarse.merge(std::move(fine)) == 99);
+    CHECK(coarse.size() == 1);
+    CHECK(fine.size() == 99);
+    CHECK(parents_exact(coarse));
+    CHECK(parents_exact(shallow));
+}
+
+static void test_split_off_parents() {
+    Tree tree{{0, 0}, {101, 101}, 2, 16};
+    auto points = random_points(tree, 3000, 7);
+    Tree part = tree.split_off({-60, -20}, {40, 90});
+    CHECK(parents_exact(tree));
+    CHECK(parents_exact(part));
+
+    // Hinted lookups climb the links, they must stay in the tree after the other one is gone.
+    { Tree gone = std::move(part); }
+    Tree::viterator hint;
+    size_t found = 0;
+    for (auto &point: points) found += tree.at(point, hint) != nullptr;
+    CHECK(found == tree.size());
+}
+
+static void test_multimap() {
+    Tree tree{{0, 0}, {100, 100}, 4, 10, false, 0, true};
+    for (int i = 0; i < 4; ++i) CHECK(tree.insert({1, 1}, i).second);
+    // Copies don't take the room of other coordinates, a normal tree would accept this point too.
+    CHECK(tree.insert({1 + 1e-9, 1}, 10).second);
+    for (int i = 4; i < 20; ++i) CHECK(tree.insert({1, 1}, i).second);
+    CHECK(tree.size() == 21);
+
+    CHECK(tree.count({1, 1}) == 20);
+    CHECK(tree.count({1 + 1e-9, 1}) == 1);
+    CHECK(tree.count({2, 2}) == 0);
+    auto copies = tree.equal_range({1, 1});
+    CHECK(copies.size() == 20);
+    int sum = 0;
+    for (int *data: copies) sum += *data;
+    CHECK(sum == 19 * 20 / 2);
+
+    CHECK(tree.remove({1, 1}, [](const int &data) { return data % 2 == 0; }) == 10);
+    CHECK(tree.count({1, 1}) == 10);
+    CHECK(tree.size() == 11);
+    for (int *data: tree.equal_range({1, 1})) CHECK(*data % 2 == 1);
+    CHECK(tree.remove({1, 1}, [](const int &) { return true; }) == 10);
+    CHECK(tree.count({1, 1}) == 0);
+    CHECK(tree.count_in_region({-100, -100}, {100, 100}) == 1);
+
+    // With bucket size 1, two copies must not block a neighbour that a normal tree separates from them.
+    Tree normal{{0, 0}, {100, 100}, 1, 30};
+    CHECK(normal.insert({5, 5}, 1).second);
+    CHECK(normal.insert({5 + 1e-6, 5}, 3).second);
+    Tree single{{0, 0}, {100, 100}, 1, 30, false, 0, true};
+    CHECK(single.insert({5, 5}, 1).second);
+    CHECK(single.insert({5, 5}, 2).second);
+    CHECK(single.insert({5 + 1e-6, 5}, 3).second);
+    CHECK(single.count({5, 5}) == 2);
+    CHECK(single.size() == 3);
+}
+
+static std::vector<TraceEvent> read_trace(const char *path) {
+    std::vector<TraceEvent> events;
+    TraceReader reader(path);
+    TraceHeader header{};
+    if (!reader.header(header)) return events;
+    TraceEvent event{};
+    while (reader.next(event)) events.push_back(event);
+    return events;
+}
+
+static void test_trace() {
+    const char *path = "test_quadtree.trace";
+    {
+        TraceWriter writer(path);
+        Tree tree{{0, 0}, {100, 100}, 4, 10, false, 0, true};
+        tree.insert({1, 1}, 0);
+        CHECK(tree.trace(&writer));
+        for (int i = 1; i < 6; ++i) tree.insert({1, 1}, i);
+        // Copies 1 to 5 and the updated 7 are odd.
+        CHECK(tree.update({1, 1}, 7));
+        CHECK(tree.update({2, 2}, 8));
+        CHECK(tree.remove({1, 1}, [](const int &data) { return data % 2 == 1; }) == 4);
+        // The fallback merge reads the buckets of other, which must not show up as a query in its trace.
+        Tree other{{0, 0}, {50, 50}, 4, 10, false, 0, true};
+        TraceWriter other_writer("test_quadtree_other.trace");
+        other.insert({3, 3}, 9);
+        CHECK(other.trace(&other_writer));
+        CHECK(tree.merge(std::move(other)) == 0);
+        tree.trace(nullptr);
+    }
+    std::vector<TraceEvent> events = read_trace(path);
+    std::vector<trace_op> ops;
+    for (auto &event: events) ops.push_back(event.op);
+    std::vector<trace_op> expected{TRACE_LOAD, TRACE_INSERT, TRACE_INSERT, TRACE_INSERT, TRACE_INSERT, TRACE_INSERT,
+                                   TRACE_UPDATE, TRACE_INSERT, TRACE_REMOVE_IF, TRACE_INSERT};
+    CHECK(ops == expected);
+    if (ops == expected) CHECK(events[8].count == 4);
+
+    std::vector<TraceEvent> other_events = read_trace("test_quadtree_other.trace");
+    for (auto &event: other_events) CHECK(event.op != TRACE_REGION);
+    remove(path);
+    remove("test_quadtree_other.trace");
+
+    // Expiry trees can't be replayed.
+    typedef Expiring<int> Ping;
+    QuadTree<Ping, std::pair<Vertex, Ping>, std::vector<std::pair<Vertex, Ping>>, ExpiryAggregate<Ping>> pings;
+    TraceWriter writer("test_quadtree_expiry.trace");
+    CHECK(!pings.trace(&writer));
+    remove("test_quadtree_expiry.trace");
+
+    // Header and coordinates come back with full long double precision, regions with both corners.
+    {
+        TraceWriter region_writer(path);
+        Tree tree{{0.1L, -0.3L}, {100, 100}, 3, 12, true, 0, false};
+        CHECK(tree.trace(&region_writer));
+        tree.insert({1.0L / 3, 2.0L / 3}, 1);
+        tree.data_in_region({-1.0L / 7, 0.1L}, {5, 6});
+        tree.at({1.0L / 3, 2.0L / 3});
+        tree.remove({1.0L / 3, 2.0L / 3});
+    }
+    TraceReader reader(path);
+    TraceHeader header{};
+    CHECK(reader.header(header));
+    CHECK(header.center == Vertex(0.1L, -0.3L) && header.range == Vertex(100, 100));
+    CHECK(header.bucket_size == 3 && header.depth == 12 && header.sort == 1 && header.multimap == 0);
+    TraceEvent event{};
+    std::vector<TraceEvent> region_events;
+    while (reader.next(event)) region_events.push_back(event);
+    CHECK(region_events.size() == 4);
+    if (region_events.size() == 4) {
+        CHECK(region_events[0].op == TRACE_INSERT && region_events[0].a == Vertex(1.0L / 3, 2.0L / 3));
+        CHECK(region_events[1].op == TRACE_REGION);
+        CHECK(region_events[1].a == Vertex(-1.0L / 7, 0.1L) && region_events[1].b == Vertex(5, 6));
+        CHECK(region_events[2].op == TRACE_AT && region_events[3].op == TRACE_REMOVE);
+    }
+    remove(path);
+}
+
+static void test_quantized() {
+    typedef QuadTree<int, std::pair<Vertex, int>, QuantizedBucket<int, uint16_t>> Quantized;
+    // A 2^20 grid over [-64, 64), leaves at least 4 deep so that offsets fit 16 bits.
+    Quantized tree{{0, 0}, {64, 64}, 4, 20, false, 20};
+    Quantized other{{0, 0}, {64, 64}, 4, 20, false, 20};
+    std::mt19937 random(8);
+    std::uniform_int_distribution<int> cell(0, (1 << 20) - 1);
+    std::vector<Vertex> points;
+    for (int i = 0; i < 2000; ++i) {
+        Vertex point(-64 + cell(random) * 0x1p-13L, -64 + cell(random) * 0x1p-13L);
+        if ((i % 2 == 0 ? tree : other).insert(point, i).second) points.push_back(point);
+    }
+    CHECK(!tree.insert({0.5L + 0x1p-20L, 0}, 0).second);
+
+    // Same grid, the leaves of other are grafted and still decode.
+    CHECK(tree.merge(std::move(other)) == 0);
+    CHECK(tree.size() == points.size());
+    size_t found = 0;
+    for (auto &point: points) found += tree.at(point) != nullptr;
+    CHECK(found == points.size());
+    for (auto const &entry: tree.data_in_region({-64, -64}, {64, 64}))
+        CHECK(std::find(points.begin(), points.end(), entry.first) != points.end());
+
+    Quantized part = tree.split_off({-10, -10}, {30, 30});
+    found = 0;
+    for (auto &point: points) found += tree.contains(point) + part.contains(point);
+    CHECK(found == points.size());
+
+    // 32-bit offsets under a 2^40 grid, leaves at least 8 deep. Points come back exactly after removes.
+    typedef QuadTree<int, std::pair<Vertex, int>, QuantizedBucket<int, uint32_t>> Wide;
+    Wide wide{{0, 0}, {1, 1}, 4, 40, false, 40};
+    std::uniform_int_distribution<uint64_t> fine(0, (uint64_t(1) << 40) - 1);
+    std::vector<Vertex> wide_points;
+    for (int i = 0; i < 1000; ++i) {
+        Vertex point(-1 + fine(random) * 0x1p-39L, -1 + fine(random) * 0x1p-39L);
+        if (wide.insert(point, i).second) wide_points.push_back(point);
+    }
+    for (size_t i = 0; i < wide_points.size(); i += 2) CHECK(wide.remove(wide_points[i]));
+    auto left = wide.extract_all();
+    CHECK(left.size() == wide_points.size() / 2);
+    for (auto &entry: left)
+        CHECK(std::find(wide_points.begin(), wide_points.end(), entry.first) != wide_points.end());
+    for (size_t i = 1; i < wide_points.size(); i += 2) CHECK(wide.at(wide_points[i]) != nullptr);
+}
+
+static void test_subscriptions() {
+    Tree tree{{0, 0}, {100, 100}, 4, 10};
+    std::vector<std::pair<change_event, int>> seen;
+    size_t id = tree.subscribe({0, 0}, {10, 10}, [&](change_event event, const Vertex &, const int &data) {
+        seen.emplace_back(event, data);
+    });
+
+    tree.insert({5, 5}, 1);
+    tree.insert({50, 50}, 2);
+    tree.insert({10, 5}, 3);
+    tree.update({5, 5}, 4);
+    tree.remove({5, 5});
+    tree.remove({50, 50});
+
+    CHECK(seen.size() == 3);
+    if (seen.size() == 3) {
+        CHECK(seen[0].first == CHANGE_INSERT && seen[0].second == 1);
+        CHECK(seen[1].first == CHANGE_UPDATE && seen[1].second == 4);
+        CHECK(seen[2].first == CHANGE_REMOVE);
+    }
+
+    CHECK(tree.unsubscribe(id));
+    CHECK(!tree.unsubscribe(id));
+    tree.insert({6, 6}, 5);
+    CHECK(seen.size() == 3);
+}
+
+static void test_nearest_cursor() {
+    Tree tree{{0, 0}, {101, 101}, 8, 20};
+    auto points = random_points(tree, 3000, 4);
+
+    Vertex query{12.5, -40};
+    std::vector<long double> distances;
+    for (auto &point: points) {
+        Vertex d = point - query;
+        distances.push_back(std::sqrt(d.x * d.x + d.y * d.y));
+    }
+    std::sort(distances.begin(), distances.end());
+
+    auto cursor = tree.nearest_cursor(query);
+    for (size_t i = 0; i < points.size(); ++i) {
+        auto next = cursor.next();
+        CHECK(next);
+        if (!next) break;
+        Vertex d = next->first - query;
+        CHECK(std::abs(std::sqrt(d.x * d.x + d.y * d.y) - distances[i]) < 1e-12);
+    }
+    CHECK(!cursor.next());
+
+    // The cursor reads a snapshot, writes to the tree don't disturb it.
+    auto early = tree.nearest_cursor({0, 0});
+    auto first = early.next();
+    CHECK(first);
+    tree.remove(first->first);
+    random_points(tree, 500, 5);
+    CHECK(early.next());
+}
+
+struct Pair {
+    int a;
+    int b;
+};
+
+static void test_concurrent_update() {
+    // One writer overwrites values with update() while a reader checks that it never sees a torn value.
+    QuadTree<Pair> tree{{0, 0}, {100, 100}, 4, 16};
+    std::vector<Vertex> points;
+    for (int i = 0; i < 400; ++i) {
+        points.emplace_back(-90 + (i % 20) * 9, -90 + (i / 20) * 9);
+        tree.insert(points.back(), {0, 0});
+    }
+
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0}, missing{0};
+    std::thread reader([&] {
+        while (!done.load(std::memory_order_acquire)) {
+            for (auto &point: points) {
+                Pair value{};
+                if (!tree.read_at(point, value)) ++missing;
+                else if (value.b != -value.a) ++torn;
+            }
+            auto region = tree.read_data_in_region({-50, -50}, {50, 50});
+            for (auto &entry: region)
+                if (entry.second.b != -entry.second.a) ++torn;
+        }
+    });
+
+    for (int round = 1; round <= 500; ++round)
+        for (auto &point: points) CHECK(tree.update(point, {round, -round}));
+    done.store(true, std::memory_order_release);
+    reader.join();
+
+    CHECK(torn.load() == 0);
+    CHECK(missing.load() == 0);
+    CHECK(tree.size() == points.size());
+}
+
+#ifdef __unix__
+static void test_protocol() {
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+    // Transfers larger than the socket buffer go through in pieces.
+    std::vector<uint32_t> sent(1 << 18), received(sent.size());
+    for (size_t i = 0; i < sent.size(); ++i) sent[i] = (uint32_t) (i * 2654435761u);
+    bool read_ok = false;
+    std::thread reader([&] { read_ok = read_all(sockets[1], received.data(), received.size() * sizeof(uint32_t)); });
+    CHECK(write_all(sockets[0], sent.data(), sent.size() * sizeof(uint32_t)));
+    reader.join();
+    CHECK(read_ok && received == sent);
+
+    // A descriptor sent along with the hello arrives as a new descriptor of the same pipe.
+    int pipe_fds[2];
+    CHECK(pipe(pipe_fds) == 0);
+    ProtoHello hello{proto_magic, sizeof(ProtoPoint), 42, {1, 2}, {3, 4}};
+    CHECK(send_with_fd(sockets[0], &hello, sizeof(hello), pipe_fds[1]));
+    ProtoHello got{};
+    int fd = receive_with_fd(sockets[1], &got, sizeof(got));
+    CHECK(fd >= 0 && fd != pipe_fds[1]);
+    CHECK(got.magic == proto_magic && got.count == 42 && got.range[1] == 4);
+    char byte = 'q', echoed = 0;
+    CHECK(write(fd, &byte, 1) == 1 && read(pipe_fds[0], &echoed, 1) == 1 && echoed == 'q');
+
+    // Without a descriptor attached, receive_with_fd reports none.
+    CHECK(write_all(sockets[0], &hello, sizeof(hello)));
+    CHECK(receive_with_fd(sockets[1], &got, sizeof(got)) == -1);
+
+    CHECK(proto_arity(PROTO_REGION) == 4 && proto_arity(PROTO_AT) == 2 && proto_arity(PROTO_NEAREST) == 2);
+
+    // A closed peer ends reads and fails writes, without SIGPIPE.
+    close(sockets[1]);
+    uint32_t value = 0;
+    CHECK(!write_all(sockets[0], sent.data(), sent.size() * sizeof(uint32_t)));
+    close(sockets[0]);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    close(sockets[0]);
+    CHECK(!read_all(sockets[1], &value, sizeof(value)));
+    close(sockets[1]);
+    close(fd);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+#endif
+
+int main() {
+    test_spatial_join();
+    test_aggregates();
+    test_rasterize();
+    test_snapshots();
+    test_curve_order();
+    test_grid_descent();
+    test_small_vector();
+    test_policy();
+    test_freeze();
+    test_segments();
+    test_polygon();
+    test_index_bucket();
+    test_memory_resource();
+    test_expire();
+    test_estimate_count();
+    test_sample();
+    test_hinted_insert();
+    test_merge_split_off();
+    test_merge_fallback();
+    test_split_off_parents();
+    test_multimap();
+    test_trace();
+    test_quantized();
+    test_subscriptions();
+    test_nearest_cursor();
+    test_concurrent_update();
+#ifdef __unix__
+    test_protocol();
+#endif
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}